@@ -22,15 +22,30 @@
  * 3. For non git tree, print all the files under it and then
  *    continue the check with its sub directories.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <openssl/evp.h>
+#include <zlib.h>
 
-#define SUBDIRNO 4096
-#define SUBFILENO 4096
 
 static char git_files[][128] = {
 	/* git files */
@@ -92,16 +107,3636 @@ static int exception_list_array_size
 	= sizeof(exception_list) / sizeof(exception_list[0]);
 static int sum_break_layout_rule, sum_dir_name_not_with_git,
 	   sum_non_bare_git, sum_not_in_git;
+static int sum_errors;
+static int sum_stale_locks;
+static int sum_garbage;
+static int sum_verified, sum_corrupt, sum_corrupt_repos;
+static int sum_idle;
+
+/* transient errors (ESTALE, EIO) are retried this many times */
+static int opt_retries = 3;
+
+/* -x: do not descend into directories on other filesystems */
+static int opt_one_file_system;
+static dev_t root_dev;
+
+/* -L: follow symlinks, visiting every physical directory only once */
+static int opt_follow;
+
+/*
+ * Set of (st_dev, st_ino) pairs, open addressing with linear probing.
+ * Inode 0 is never handed out by Linux filesystems, so an all-zero slot
+ * marks an empty entry.
+ */
+struct devino {
+	dev_t dev;
+	ino_t ino;
+};
+
+struct devino_set {
+	struct devino *slots;
+	size_t mask;
+	size_t count;
+};
+
+static struct devino_set visited;
+
+/*
+ * The traversal keeps its frontier on the heap rather than on the C
+ * stack. Every directory still to be scanned is a node that holds the
+ * index of its parent node and the offset of its name in walk_names; a
+ * scanned directory stays around only while some of its subdirectories
+ * are pending. A depth-first walk thus holds the siblings along the
+ * current path and nothing more.
+ *
+ * Pending nodes sit in a deque. They are taken from the back, depth
+ * first, or with --bfs N from the front, breadth first, as long as fewer
+ * than N are pending.
+ *
+ * Checkpointing: the pending nodes in scan order plus the counters, the
+ * stdout offset, the -L visited set and the options that shape the
+ * report is all that is needed to continue an interrupted scan.
+ *
+ * Every directory also carries a weight, its estimated share of the whole
+ * tree: the root weighs 1 and a directory's weight is split evenly among
+ * its subdirectories. The weights of the pending directories add up to
+ * the part of the tree that has not been visited yet.
+ */
+#define CHECKPOINT_MAGIC "gitree-checkpoint 2"
+#define WALK_NONE 0xffffffff
+
+struct walk_node {
+	uint32_t parent;	/* WALK_NONE for the directories given */
+	uint32_t name;		/* in walk_names, the full path at the top */
+	uint32_t refs;		/* 1 until scanned, plus pending children */
+	uint32_t inv;		/* its inventory record */
+	uint32_t fd;		/* its slot in the descriptor cache */
+	double weight;
+	double secs;		/* spent in the subtree so far */
+	unsigned long long entries;
+};
+
+static struct walk_node *walk_nodes;
+static uint32_t walk_nodes_n, walk_nodes_size, walk_free = WALK_NONE;
+static char *walk_names;
+static size_t walk_names_len, walk_names_size, walk_names_dead;
+static uint32_t *walk_deque;		/* ring of pending nodes */
+static size_t walk_head, walk_len, walk_size;
+static uint32_t walk_current = WALK_NONE;	/* node being scanned */
+static int opt_bfs;
+
+/*
+ * Descriptor cache: a directory with subdirectories left to scan keeps
+ * a descriptor in an LRU cache, so its children are opened with openat()
+ * and the kernel only looks up their last component. At most --fd-budget
+ * descriptors are kept; the least recently used one is closed to make
+ * room, and the children of that directory are then opened by path.
+ */
+#define FD_BUDGET 1024
+
+struct fd_slot {
+	int fd;
+	uint32_t node;
+	uint32_t prev, next;	/* toward more and less recently used */
+};
+
+static struct {
+	struct fd_slot *slots;
+	uint32_t head, tail, free;
+} fd_cache = { NULL, WALK_NONE, WALK_NONE, WALK_NONE };
+static int opt_fd_budget = -1;
+
+/*
+ * Cost model: the time and number of entries of every subtree with at
+ * least COST_MIN_ENTRIES entries is saved to the cost file at the end of
+ * a scan. The next scan loads it and takes the subdirectories of every
+ * directory in decreasing order of their previous cost, so the biggest
+ * subtrees and repos are started first instead of holding up the end.
+ */
+#define COST_MAGIC "gitree-costs 1"
+#define COST_MIN_ENTRIES 1000
+
+struct cost {
+	char *path;
+	double secs;
+	unsigned long long entries;
+	int measured;		/* by this scan, not loaded */
+};
+
+struct cost_index {
+	struct cost **slots;
+	size_t mask;
+	size_t count;
+};
+
+static char *opt_cost_file;
+static struct cost_index costs;
+
+static char *opt_checkpoint;
+static int opt_checkpoint_interval = 60;
+static time_t last_checkpoint;
+
+static const struct {
+	const char *name;
+	int *value;
+} counters[] = {
+	{ "break_layout_rule",		&sum_break_layout_rule },
+	{ "dir_name_not_with_git",	&sum_dir_name_not_with_git },
+	{ "non_bare_git",		&sum_non_bare_git },
+	{ "not_in_git",			&sum_not_in_git },
+	{ "errors",			&sum_errors },
+	{ "stale_locks",		&sum_stale_locks },
+	{ "garbage",			&sum_garbage },
+	{ "verified",			&sum_verified },
+	{ "corrupt",			&sum_corrupt },
+	{ "corrupt_repos",		&sum_corrupt_repos },
+	{ "idle",			&sum_idle },
+};
+
+static int counters_array_size = sizeof(counters) / sizeof(counters[0]);
+
+/* byte totals, saved in checkpoints next to the counters */
+static unsigned long long du_repo_bytes, du_repo_alloc,
+			  du_stray_bytes, du_stray_alloc;
+static unsigned long long garbage_bytes;
+
+static const struct {
+	const char *name;
+	unsigned long long *value;
+} totals[] = {
+	{ "repo_bytes",			&du_repo_bytes },
+	{ "repo_alloc",			&du_repo_alloc },
+	{ "stray_bytes",		&du_stray_bytes },
+	{ "stray_alloc",		&du_stray_alloc },
+	{ "garbage_bytes",		&garbage_bytes },
+};
+
+static int totals_array_size = sizeof(totals) / sizeof(totals[0]);
+
+/* --time-budget and --max-dirs: stop cleanly once either is used up */
+static int opt_time_budget, opt_max_dirs;
+static time_t scan_start;
+static int dirs_scanned;
+static int budget_exhausted;
+static char **unvisited;
+static double *unvisited_weights;
+static int unvisited_n;
+
+/*
+ * Throttling for shared storage: token buckets on directories/sec and
+ * metadata ops/sec (opendir and stat calls). With --backoff-latency the
+ * directory rate is halved whenever reading one directory takes longer
+ * than the threshold and creeps back up by one dir/sec per fast one.
+ */
+struct bucket {
+	pthread_mutex_t lock;	/* for all of the fields */
+	double rate;		/* tokens per second, 0 is unlimited */
+	double tokens;		/* below 0 once sleepers are queued */
+	struct timespec last;
+};
+
+static struct bucket dir_bucket = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static struct bucket op_bucket = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static double opt_max_dir_rate;
+static double opt_backoff_latency;	/* seconds */
+static __thread double throttle_slept;	/* seconds, kept out of latency */
+static int opt_idle_io;
+
+/*
+ * Live progress: the scan bumps these with relaxed atomic adds and a
+ * reporter thread samples them every --progress seconds, so the hot path
+ * never takes a lock. The ETA compares the entries seen so far with the
+ * used inode count of the root's filesystem, which makes it an upper
+ * bound when the tree is only part of the filesystem.
+ */
+static struct {
+	unsigned long dirs, entries, repos;
+} progress;
+
+#define progress_inc(field) \
+	__atomic_fetch_add(&progress.field, 1, __ATOMIC_RELAXED)
+
+static int opt_progress;		/* seconds between reports */
+static char *opt_status_file;
+static unsigned long long used_inodes;
+static pthread_t progress_thread;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+static int progress_done;
+
+/*
+ * Worker pool for batches of independent syscalls. pool_run() hands out
+ * item indexes to the workers and the calling thread through an atomic
+ * cursor and returns once every item is done.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	pthread_t *threads;
+	int nthreads;
+	unsigned long generation;
+	void (*fn)(void *arg, size_t i);
+	void *arg;
+	size_t n, next;
+	int busy;
+	int running;		/* a pool_run() is using the workers */
+	int active;		/* threads taking items in this batch */
+	int tuned;		/* the batch counts towards -j auto */
+	FILE *out;		/* the caller's, for errors the items report */
+	unsigned long long latency_ns;	/* summed over the batch's items */
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static int opt_jobs;
+
+/*
+ * -j auto: start AUTO_JOBS_MAX threads but let only "limit" of them take
+ * items. After every window of batches, throughput X and mean item
+ * latency W give the concurrency the storage is serving, L = X * W by
+ * Little's law. Like TCP slow start, the limit doubles while each step
+ * still buys 10% more throughput. After that it follows the knee of the
+ * throughput curve, the best throughput times the unloaded latency, set
+ * a bit above it so that it keeps probing for more. The best throughput
+ * decays so the limit comes back down when the storage slows.
+ */
+#define AUTO_JOBS_MAX 64
+#define AUTO_WINDOW_SECS 0.05
+#define AUTO_WINDOW_ITEMS 64
+
+static int opt_jobs_auto;
+static struct {
+	int limit;
+	unsigned long items;
+	double secs, latency;	/* of the current window */
+	double best_x, min_w;	/* items/sec, seconds */
+	int windows;
+	int settled;		/* out of slow start */
+} tune;
+
+/*
+ * Pipeline: with --validate-jobs N, gitree() only discovers repos and
+ * queues them, and N validation workers run the per-repo checks. The
+ * queue is a bounded lock-free ring with a sequence number per cell;
+ * semaphores count the full and free cells to sleep on.
+ *
+ * The report keeps the order of a sequential scan. Everything is printed
+ * to the thread's "out", which is stdout without a pipeline. With one,
+ * it is a segment: an in-memory stream holding the discovery output up
+ * to a repo, followed by that repo's report. Segments are numbered and
+ * written to stdout in order as they complete. At most REORDER_MAX can
+ * be outstanding, which bounds what is held back for reordering.
+ *
+ * Workers count findings in their thread's "tally". A repo's tally is
+ * added to the totals when its segment is written out.
+ */
+#define QUEUE_SIZE 256		/* power of two */
+#define REORDER_MAX 1024
+
+struct tally {
+	int breaks, non_bare, name_not_git, stale_locks, garbage;
+	int verified, corrupt, idle;
+	unsigned long long repo_bytes, repo_alloc, garbage_bytes;
+	time_t last_activity;
+	struct du_link *links;	/* hardlinked files, not yet deduplicated */
+	size_t nlinks;
+};
+
+struct segment;
+
+struct repo_job {
+	char *dirname;
+	uint32_t inv_parent;	/* inventory record of its parent */
+	struct segment *seg;
+	struct tally tally;
+};
+
+struct segment {
+	FILE *fp;
+	char *buf;
+	size_t len;
+	struct repo_job *job;	/* accounted once written out */
+	int done;
+};
+
+static struct {
+	struct {
+		unsigned long seq;
+		struct repo_job *job;
+	} cells[QUEUE_SIZE];
+	unsigned long head, tail;
+	sem_t items, slots;
+} queue;
+
+static int opt_validate_jobs;
+static pthread_t *validators;
+static int nvalidators;
+static struct segment segments[REORDER_MAX];
+static unsigned long seg_next, seg_emit;	/* next to open, to write */
+static struct segment *discovery_seg;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t hardlinks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t inv_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread FILE *out;
+static __thread struct tally tally;
+
+/* syscall batches smaller than this are not worth waking the workers for */
+#define POOL_MIN_BATCH 32
+
+/*
+ * --du: apparent size and allocated blocks per repo and per directory
+ * of stray files. Files with more than one link are charged once, to
+ * the first repo or directory they are seen in, so the totals match the
+ * real disk consumption of hardlinked local clones. The largest --top
+ * repos and stray directories are kept in min-heaps.
+ */
+#define DU_BATCH 4096
+
+struct du_item {
+	size_t path;		/* offset into the batch arena */
+	unsigned long long size, alloc;
+	dev_t dev;
+	ino_t ino;
+	int err;
+	unsigned int nlink;
+	int is_dir;
+};
+
+/*
+ * Repos are validated out of order, so which of two repos sharing a
+ * hardlinked file gets charged for it is settled when they are reported.
+ */
+struct du_link {
+	dev_t dev;
+	ino_t ino;
+	unsigned long long size, alloc;
+};
+
+struct du_batch {
+	char *arena;
+	size_t arena_len, arena_size;
+	struct du_item *items;
+	size_t n;
+	unsigned long long size, alloc;	/* after hardlink dedup */
+	int defer_links;		/* collect hardlinks instead */
+	struct du_link *links;
+	size_t nlinks, links_size;
+};
+
+struct du_entry {
+	char *path;
+	unsigned long long size, alloc;
+};
+
+struct du_heap {
+	struct du_entry *e;
+	int n;
+};
+
+static int opt_du;
+static int opt_top = 10;
+static struct devino_set hardlinks;
+static struct du_heap top_repos, top_strays;
+
+/*
+ * --dup-packs: pack names embed the checksum of their content, so two
+ * objects/pack/pack-<sha>.pack files with the same name are identical.
+ * Index every pack by name across all repos; a pack stored under more
+ * than one inode is space that alternates or hardlinks would reclaim,
+ * and repos sharing most of their pack bytes are likely forks.
+ */
+struct pack_copy {
+	int repo;
+	dev_t dev;
+	ino_t ino;
+};
+
+struct pack {
+	char *name;		/* the <sha> part */
+	unsigned long long size;
+	struct pack_copy *copies;
+	int ncopies;
+	int distinct;		/* number of different inodes */
+};
+
+struct pack_index {
+	struct pack **slots;
+	size_t mask;
+	size_t count;
+};
+
+struct repo_pair {
+	uint64_t key;		/* repo ids, smaller one in the high half */
+	unsigned long long shared;	/* an empty pack shares 0 bytes */
+	int used;
+};
+
+static int opt_dup_packs;
+static struct pack_index packs;
+static char **pack_repos;		/* repo id -> path */
+static unsigned long long *pack_repo_bytes;
+static int pack_repos_n, pack_repos_size;
+
+/* pairs are only counted among this many copies of one pack */
+#define PAIR_COPIES_MAX 64
+
+/*
+ * --locks: *.lock files and gc.pid left behind by a crashed git process
+ * block every later push or gc. The top level of each repo is checked
+ * while check_gitree() reads it, refs/ is searched in parallel, and
+ * locks older than --lock-age are reported as STALE LOCK findings
+ * instead of layout rule breaks.
+ */
+struct lock_walk {
+	char *dirname;
+	char **found;		/* "path age" lines */
+	int nfound;
+	time_t now;		/* the repo's audit_now, for the workers */
+};
+
+static int opt_locks;
+static int opt_lock_age = 3600;
+/* reference time for lock and file ages, taken as each repo is checked */
+static __thread time_t audit_now;
+
+/*
+ * --garbage: leftovers of interrupted pushes, repacks and gc runs in
+ * objects/ of a repo. Each leftover is sized in parallel; one that has
+ * not been touched for --garbage-age seconds is reclaimable.
+ */
+static const char *garbage_prefixes[][2] = {
+	/* directory under objects/, name prefix */
+	{ "",		"incoming-" },
+	{ "",		"tmp_objdir-" },
+	{ "/pack",	"tmp_pack_" },
+	{ "/pack",	"tmp_idx_" },
+	{ "/pack",	".tmp-" },
+};
+
+static int garbage_prefixes_array_size
+	= sizeof(garbage_prefixes) / sizeof(garbage_prefixes[0]);
+
+struct garbage {
+	char *path;
+	unsigned long long size;
+	time_t mtime;		/* newest mtime in the leftover */
+	int gone;		/* removed before it could be sized */
+};
+
+static int opt_garbage;
+static int opt_garbage_age = 3600;
+
+/*
+ * --verify: a lightweight fsck. Every pack and its .idx end with a
+ * checksum of their content, and the .idx also records the checksum of
+ * its pack; a sample of loose objects is inflated and rehashed. Hashing
+ * goes through OpenSSL, which uses the SHA extensions of the CPU where
+ * there are any, and the files of a repo are spread over the worker
+ * pool.
+ */
+enum verify_kind {
+	VERIFY_PACK,
+	VERIFY_IDX,
+	VERIFY_LOOSE,
+};
+
+struct verify_item {
+	char *path;
+	enum verify_kind kind;
+	int hashlen;			/* 20 for SHA-1, 32 for SHA-256 */
+	unsigned char trailer[32];	/* checksum at the end of the file */
+	unsigned char pack_sum[32];	/* .idx: checksum of its pack */
+	const char *err;
+};
+
+static int opt_verify;
+static int opt_verify_sample = 16;
+
+/*
+ * --idle-days: the last activity of a repo is the timestamp of the last
+ * reflog entry, read from the tail of logs/HEAD (or of the most recently
+ * modified file under logs/refs) so that the cost does not depend on
+ * the length of the reflog. Without reflogs, the mtime of packed-refs
+ * and of the refs/heads and refs/tags directories is used.
+ */
+#define REFLOG_TAIL 512
+#define REFLOG_TAIL_MAX 65536
+
+static int opt_idle_days = -1;
+
+/*
+ * --inventory: a compact binary image of the scanned tree. Directories
+ * are fixed-size records in scan order that point to their parent and
+ * store only their own name, so a path costs one name component. The
+ * file is meant to be mmap()ed: a header, the record array, the name
+ * pool and the summary counters, with child and sibling links filled in
+ * when the scan ends.
+ */
+#define INV_MAGIC "GTREEINV"
+#define INV_VERSION 1
+#define INV_NONE 0xffffffffU
+
+/* header flags */
+#define INV_PARTIAL	1	/* scan was stopped by a budget */
+
+struct inv_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t record_size;
+	uint32_t ncounters;
+	uint64_t nrecords;
+	uint64_t records_off;
+	uint64_t names_off;
+	uint64_t names_len;
+	uint64_t counters_off;
+	uint32_t first_root;
+	uint32_t reserved[3];
+};
+
+enum inv_kind {
+	INV_DIR,		/* not a repo, descended into */
+	INV_REPO,
+	INV_ERROR,		/* could not be read */
+	INV_SKIPPED,		/* alias of a directory already visited */
+};
+
+/* record flags */
+#define INV_NON_BARE		1
+#define INV_NAME_NOT_GIT	2
+#define INV_CORRUPT		4
+#define INV_IDLE		8
+
+struct inv_record {
+	uint32_t parent;
+	uint32_t first_child;
+	uint32_t next_sibling;
+	uint8_t kind;
+	uint8_t flags;
+	uint16_t reserved;
+	uint64_t name;		/* offset into the name pool */
+	uint32_t files;		/* layout rule breaks, or files not in git */
+	uint32_t locks;		/* stale locks */
+	uint32_t corrupt;	/* corrupt files */
+	uint32_t reserved2;
+	uint64_t size;		/* allocated bytes of the repo or the strays */
+	uint64_t garbage;	/* reclaimable bytes */
+	int64_t activity;	/* last activity, 0 if unknown */
+};
+
+struct inv_counter {
+	char name[24];
+	uint64_t value;
+};
+
+struct inventory {
+	unsigned char *map;
+	size_t len;
+	struct inv_header *h;
+	struct inv_record *rec;
+	char *names;
+	struct inv_counter *counters;
+};
+
+/* counter values before a directory was checked, to attribute findings */
+struct inv_snap {
+	int not_in_git;
+	unsigned long long stray_alloc;
+};
+
+static char *opt_inventory;
+static FILE *inv_fp, *inv_names;
+static uint64_t inv_nrecords, inv_names_len;
+
+/* print the entries of every directory by name, not in readdir order */
+static int opt_sort;
+
+/* descend into subdirectories by inode number, for fewer disk seeks */
+static int opt_inode_order;
+
+/* count the findings for the summary without reporting each of them */
+static int opt_summary;
+#define report(...) \
+	do { if (!opt_summary) fprintf(out, __VA_ARGS__); } while (0)
+
+/*
+ * Directories with more than opt_aggregate files not in a git tree get
+ * one line with their count and the first opt_aggregate_samples names
+ * instead of a line per file. With --sort these are the first by name,
+ * so all names are kept until the directory is done.
+ */
+static int opt_aggregate;
+static int opt_aggregate_samples = 5;
+
+/*
+ * Files of a directory are buffered only until it is known whether it
+ * is a repo. Past STREAM_BUFFER files, the rest of the directory is read
+ * for the repo markers alone and, if it is not a repo, read once more to
+ * report its files as they come.
+ */
+#define STREAM_BUFFER 64
+
+enum stream_state {
+	STREAM_BUFFERING,	/* files go to the buffer */
+	STREAM_MARKERS,		/* buffer overflowed, look for markers */
+	STREAM_FILES,		/* not a repo, report files right away */
+};
+
+/* Files not in a git tree of the directory being checked. */
+struct stray {
+	char *dirname;
+	int excepted;		/* in the exception list */
+	char **files;		/* kept to be sorted or aggregated */
+	int nfiles, files_size;
+	int count;		/* all of them, kept or not */
+	struct du_batch du;
+};
+
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+
+static size_t devino_hash(dev_t dev, ino_t ino)
+{
+	uint64_t h = (uint64_t)ino ^ ((uint64_t)dev * 0x9e3779b97f4a7c15ULL);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static void devino_set_grow(struct devino_set *set)
+{
+	struct devino *old = set->slots;
+	size_t old_size = old ? set->mask + 1 : 0;
+	size_t size = old_size ? old_size * 2 : 1024;
+	size_t i, k;
+
+	set->slots = calloc(size, sizeof(*set->slots));
+	if (set->slots == NULL) {
+		fprintf(stderr, "ERROR: gitree: out of memory\n");
+		exit(-1);
+	}
+	set->mask = size - 1;
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].ino == 0)
+			continue;
+		k = devino_hash(old[i].dev, old[i].ino) & set->mask;
+		while (set->slots[k].ino != 0)
+			k = (k + 1) & set->mask;
+		set->slots[k] = old[i];
+	}
+	free(old);
+}
+
+/* Return 1 if (dev, ino) was not in the set yet, 0 if it was. */
+static int devino_set_insert(struct devino_set *set, dev_t dev, ino_t ino)
+{
+	size_t k;
+
+	if (set->slots == NULL || set->count * 2 >= set->mask + 1)
+		devino_set_grow(set);
+
+	k = devino_hash(dev, ino) & set->mask;
+	while (set->slots[k].ino != 0) {
+		if (set->slots[k].dev == dev && set->slots[k].ino == ino)
+			return 0;
+		k = (k + 1) & set->mask;
+	}
+	set->slots[k].dev = dev;
+	set->slots[k].ino = ino;
+	set->count++;
+	return 1;
+}
+
+static size_t string_hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static int str_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: ./gitree pathname\n"
-			"Perform conformance check, give warnings when\n"
-			"1. files break Git repo layout rule\n"
-			"2. git dirs name not terminated with .git\n"
-			"3. git dirs non-bare git tree\n"
-			"4. files not in a git tree\n");
-	exit(-1);
+	fprintf(stderr, "Usage: ./gitree [options] pathname\n"
+			"Perform conformance check, give warnings when\n"
+			"1. files break Git repo layout rule\n"
+			"2. git dirs name not terminated with .git\n"
+			"3. git dirs non-bare git tree\n"
+			"4. files not in a git tree\n"
+			"\n"
+			"Options:\n"
+			"  -x, --one-file-system  stay on the filesystem of pathname,\n"
+			"                         never trigger automounts\n"
+			"  -L, --follow           follow symlinks, check every\n"
+			"                         physical directory only once\n"
+			"  --checkpoint FILE      periodically save scan state to FILE\n"
+			"  --checkpoint-interval SECS\n"
+			"                         seconds between checkpoints (60)\n"
+			"  --resume FILE          continue the scan saved in FILE,\n"
+			"                         append stdout to the old report;\n"
+			"                         not with --du, --dup-packs or\n"
+			"                         --inventory\n"
+			"  --retries N            retry ESTALE/EIO N times (3)\n"
+			"  --time-budget SECS     stop scanning after SECS seconds\n"
+			"  --max-dirs N           stop scanning after N directories\n"
+			"  --max-dir-rate N       read at most N directories/sec\n"
+			"  --max-ops-rate N       issue at most N metadata ops/sec\n"
+			"  --backoff-latency MS   slow down while reading a directory\n"
+			"                         takes longer than MS milliseconds\n"
+			"  --idle-io              run in the idle I/O scheduling class\n"
+			"  --progress[=SECS]      report progress on stderr every\n"
+			"                         SECS seconds (5)\n"
+			"  --status-file FILE     write the progress line to FILE\n"
+			"                         instead of stderr\n"
+			"  -j, --jobs N           worker threads for batched work\n"
+			"                         (number of CPUs), or \"auto\" to\n"
+			"                         tune it to the storage while scanning\n"
+			"                         with --du, --locks or --garbage\n"
+			"  --du                   report size of every repo and of\n"
+			"                         files not in a git tree\n"
+			"  --top K                list the K largest repos and stray\n"
+			"                         directories (10)\n"
+			"  --dup-packs            find packs stored in more than one\n"
+			"                         repo, and likely forks\n"
+			"  --locks                report stale lock files in repos\n"
+			"  --lock-age SECS        locks older than SECS are stale (3600)\n"
+			"  --garbage              report leftover temporary files in\n"
+			"                         objects/ and the space they take\n"
+			"  --garbage-age SECS     leftovers untouched for SECS are\n"
+			"                         garbage (3600)\n"
+			"  --verify               verify pack and index checksums and\n"
+			"                         a sample of loose objects\n"
+			"  --verify-sample N      loose objects to check per repo (16)\n"
+			"  --idle-days N          report repos without activity in\n"
+			"                         the last N days\n"
+			"  --inventory FILE       write a binary inventory of the tree\n"
+			"  --sort                 check and report the entries of\n"
+			"                         every directory in name order\n"
+			"  --inode-order          descend into subdirectories in inode\n"
+			"                         order, for fewer seeks on disks\n"
+			"  --summary              only print the totals\n"
+			"  --aggregate N          report directories with more than\n"
+			"                         N files not in a git tree as one line\n"
+			"  --aggregate-samples N  file names to show on that line (5)\n"
+			"  --bfs N                scan breadth first while fewer than\n"
+			"                         N directories are pending\n"
+			"  --cost-file FILE       scan the subtrees that took longest\n"
+			"                         in the last scan first, save the\n"
+			"                         times of this one to FILE\n"
+			"  --validate-jobs N      check repos in N threads while the\n"
+			"                         tree is being walked\n"
+			"  --fd-budget N          keep up to N directories open to\n"
+			"                         open their subdirectories with\n"
+			"                         openat() (1024), 0 disables\n"
+			"\n"
+			"       ./gitree query INVENTORY [PREFIX]\n"
+			"List the repos in INVENTORY under PREFIX and count the files\n"
+			"not in a git tree there.\n"
+			"\n"
+			"       ./gitree diff OLD NEW\n"
+			"Show repos, findings and counters that changed between two\n"
+			"inventories.\n");
+	exit(-1);
+}
+
+static double elapsed(struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) +
+	       (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* Sleep "secs" on behalf of the throttle or a retry backoff. */
+static void throttle_sleep(double secs)
+{
+	usleep(secs * 1e6);
+	throttle_slept += secs;
+}
+
+/*
+ * Take one token from "b", sleeping until it is due. The token is taken
+ * under the lock, possibly driving the count negative, and the sleep
+ * happens after unlocking so other threads are not held up meanwhile.
+ */
+static void bucket_take(struct bucket *b)
+{
+	double wait = 0;
+
+	pthread_mutex_lock(&b->lock);
+	if (b->rate <= 0) {
+		pthread_mutex_unlock(&b->lock);
+		return;
+	}
+	b->tokens += elapsed(&b->last) * b->rate;
+	clock_gettime(CLOCK_MONOTONIC, &b->last);
+	/* allow bursts of up to one second worth of tokens */
+	if (b->tokens > b->rate)
+		b->tokens = b->rate;
+	b->tokens -= 1;
+	if (b->tokens < 0)
+		wait = -b->tokens / b->rate;
+	pthread_mutex_unlock(&b->lock);
+
+	if (wait > 0)
+		throttle_sleep(wait);
+}
+
+static void throttle_op(void)
+{
+	bucket_take(&op_bucket);
+}
+
+/*
+ * Feed the time it took to read one directory back into the directory
+ * rate: multiplicative decrease when the storage is slow, additive
+ * increase up to --max-dir-rate while it keeps up.
+ */
+static void throttle_feedback(double latency)
+{
+	pthread_mutex_lock(&dir_bucket.lock);
+	if (latency > opt_backoff_latency) {
+		if (dir_bucket.rate <= 0)
+			dir_bucket.rate = dirs_scanned /
+				(elapsed(&dir_bucket.last) + 1e-3);
+		dir_bucket.rate /= 2;
+		if (dir_bucket.rate < 1)
+			dir_bucket.rate = 1;
+	} else if (dir_bucket.rate > 0) {
+		dir_bucket.rate += 1;
+		if (opt_max_dir_rate > 0 && dir_bucket.rate > opt_max_dir_rate)
+			dir_bucket.rate = opt_max_dir_rate;
+	}
+	pthread_mutex_unlock(&dir_bucket.lock);
+}
+
+/* Format "secs" as 1h02m03s, dropping leading zero units. */
+static void format_duration(char *buf, size_t size, unsigned long secs)
+{
+	if (secs >= 3600)
+		snprintf(buf, size, "%luh%02lum%02lus", secs / 3600,
+			 secs / 60 % 60, secs % 60);
+	else if (secs >= 60)
+		snprintf(buf, size, "%lum%02lus", secs / 60, secs % 60);
+	else
+		snprintf(buf, size, "%lus", secs);
+}
+
+static void print_progress(FILE *fp, double secs, int final)
+{
+	unsigned long dirs, entries, repos;
+	char eta[32], line[256];
+	int len;
+
+	dirs = __atomic_load_n(&progress.dirs, __ATOMIC_RELAXED);
+	entries = __atomic_load_n(&progress.entries, __ATOMIC_RELAXED);
+	repos = __atomic_load_n(&progress.repos, __ATOMIC_RELAXED);
+	if (secs <= 0)
+		secs = 1e-3;
+
+	len = snprintf(line, sizeof(line),
+		       "%lu dirs (%.0f/s), %lu entries (%.0f/s), "
+		       "%lu repos, %d errors",
+		       dirs, dirs / secs, entries, entries / secs, repos,
+		       __atomic_load_n(&sum_errors, __ATOMIC_RELAXED));
+	if (!final && used_inodes && entries && entries < used_inodes) {
+		format_duration(eta, sizeof(eta),
+				secs * (used_inodes - entries) / entries);
+		snprintf(line + len, sizeof(line) - len,
+			 ", %.1f%% of %llu inodes, ETA %s",
+			 entries * 100.0 / used_inodes, used_inodes, eta);
+	}
+
+	if (fp == stderr && isatty(STDERR_FILENO))
+		fprintf(fp, "\r%s\033[K%s", line, final ? "\n" : "");
+	else
+		fprintf(fp, "%s\n", line);
+	fflush(fp);
+}
+
+/* Replace the status file with the current progress line. */
+static void write_status_file(double secs, int final)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", opt_status_file);
+	if ((fp = fopen(tmp, "w")) == NULL)
+		return;
+	print_progress(fp, secs, final);
+	if (fclose(fp) == 0)
+		rename(tmp, opt_status_file);
+}
+
+static void *progress_reporter(void *arg)
+{
+	struct timespec start, wake;
+	double secs;
+
+	(void)arg;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	clock_gettime(CLOCK_REALTIME, &wake);
+
+	pthread_mutex_lock(&progress_lock);
+	while (!progress_done) {
+		wake.tv_sec += opt_progress;
+		pthread_cond_timedwait(&progress_cond, &progress_lock, &wake);
+		secs = elapsed(&start);
+		if (opt_status_file)
+			write_status_file(secs, progress_done);
+		else
+			print_progress(stderr, secs, progress_done);
+	}
+	pthread_mutex_unlock(&progress_lock);
+
+	return NULL;
+}
+
+static void start_progress(char *root)
+{
+	struct statfs sfs;
+
+	if (statfs(root, &sfs) == 0 && sfs.f_files > 0 &&
+	    sfs.f_files >= sfs.f_ffree)
+		used_inodes = sfs.f_files - sfs.f_ffree;
+
+	if (pthread_create(&progress_thread, NULL, progress_reporter, NULL)) {
+		fprintf(stderr, "gitree: cannot start progress reporter\n");
+		opt_progress = 0;
+	}
+}
+
+static void stop_progress(void)
+{
+	pthread_mutex_lock(&progress_lock);
+	progress_done = 1;
+	pthread_cond_signal(&progress_cond);
+	pthread_mutex_unlock(&progress_lock);
+	pthread_join(progress_thread, NULL);
+}
+
+static void pool_run_items(void)
+{
+	struct timespec start;
+	unsigned long long ns = 0;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED)) <
+	       pool.n) {
+		if (pool.tuned)
+			clock_gettime(CLOCK_MONOTONIC, &start);
+		pool.fn(pool.arg, i);
+		if (pool.tuned)
+			ns += elapsed(&start) * 1e9;
+	}
+	if (ns)
+		__atomic_fetch_add(&pool.latency_ns, ns, __ATOMIC_RELAXED);
+}
+
+static void *pool_worker(void *arg)
+{
+	int id = (long)arg;	/* the caller of pool_run() is 0 */
+	unsigned long seen = 0;
+
+	out = stdout;
+	pthread_mutex_lock(&pool.lock);
+	for (;;) {
+		while (pool.generation == seen)
+			pthread_cond_wait(&pool.work, &pool.lock);
+		seen = pool.generation;
+		out = pool.out;
+		pthread_mutex_unlock(&pool.lock);
+
+		if (id < pool.active)
+			pool_run_items();
+
+		pthread_mutex_lock(&pool.lock);
+		if (--pool.busy == 0)
+			pthread_cond_signal(&pool.done);
+	}
+
+	return NULL;
+}
+
+static void pool_start(void)
+{
+	int i;
+
+	if (pool.threads != NULL)
+		return;
+	if (opt_jobs_auto) {
+		tune.limit = sysconf(_SC_NPROCESSORS_ONLN);
+		opt_jobs = AUTO_JOBS_MAX;
+	}
+	if (opt_jobs <= 0)
+		opt_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opt_jobs <= 1)
+		return;
+
+	/* the thread calling pool_run() is one of the workers */
+	pool.threads = calloc(opt_jobs - 1, sizeof(*pool.threads));
+	for (i = 0; i < opt_jobs - 1; i++) {
+		if (pthread_create(&pool.threads[i], NULL, pool_worker,
+				   (void *)(long)(i + 1)))
+			break;
+	}
+	pool.nthreads = i;
+	if (!opt_jobs_auto || tune.limit > i + 1)
+		tune.limit = i + 1;
+}
+
+/* Account one batch of -j auto and move the limit after a full window. */
+static void pool_tune(size_t n, double secs)
+{
+	double x, w, knee;
+	int limit;
+
+	tune.items += n;
+	tune.secs += secs;
+	tune.latency += pool.latency_ns / 1e9;
+	if (tune.secs < AUTO_WINDOW_SECS || tune.items < AUTO_WINDOW_ITEMS)
+		return;
+
+	x = tune.items / tune.secs;
+	w = tune.latency / tune.items;
+	tune.items = 0;
+	tune.secs = 0;
+	tune.latency = 0;
+	tune.windows++;
+
+	if (tune.min_w == 0 || w < tune.min_w)
+		tune.min_w = w;
+	if (!tune.settled && x > tune.best_x * 1.1) {
+		tune.best_x = x;
+		limit = tune.limit * 2;
+	} else {
+		tune.settled = 1;
+		tune.best_x *= 0.95;
+		if (x > tune.best_x)
+			tune.best_x = x;
+		knee = tune.best_x * tune.min_w;
+		limit = knee * 1.25 + 1;
+	}
+	if (limit < 1)
+		limit = 1;
+	if (limit > pool.nthreads + 1)
+		limit = pool.nthreads + 1;
+	tune.limit = limit;
+}
+
+/*
+ * Call fn(arg, i) for i in [0, n), spread over the worker pool. When the
+ * pool is already busy, for another validation worker or because fn
+ * itself calls pool_run(), the items are run by the caller. Only "tuned"
+ * batches feed -j auto: its model assumes items that wait on storage.
+ */
+static void pool_batch(size_t n, void (*fn)(void *arg, size_t i), void *arg,
+		       int tuned)
+{
+	struct timespec start;
+	size_t i;
+
+	if (pool.nthreads == 0 || n < 2 ||
+	    __atomic_exchange_n(&pool.running, 1, __ATOMIC_ACQUIRE)) {
+		for (i = 0; i < n; i++)
+			fn(arg, i);
+		return;
+	}
+
+	tuned = tuned && opt_jobs_auto;
+	if (tuned)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&pool.lock);
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.n = n;
+	pool.next = 0;
+	pool.busy = pool.nthreads;
+	pool.active = opt_jobs_auto ? tune.limit : pool.nthreads + 1;
+	pool.latency_ns = 0;
+	pool.tuned = tuned;
+	pool.out = out;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+
+	pool_run_items();
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.busy)
+		pthread_cond_wait(&pool.done, &pool.lock);
+	pthread_mutex_unlock(&pool.lock);
+	if (tuned)
+		pool_tune(n, elapsed(&start));
+	__atomic_store_n(&pool.running, 0, __ATOMIC_RELEASE);
+}
+
+static void pool_run(size_t n, void (*fn)(void *arg, size_t i), void *arg)
+{
+	pool_batch(n, fn, arg, 1);
+}
+
+static void set_idle_io(void)
+{
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+		fprintf(stderr, "gitree: ioprio_set failed, "
+			"running with default I/O priority\n");
+}
+
+/*
+ * Return 1 if the directory entry "name" under "dirp" lives on another
+ * filesystem than the scan root. AT_NO_AUTOMOUNT makes sure that looking
+ * at an autofs trigger point does not mount it: an unmounted trigger
+ * reports the autofs st_dev and is skipped like any other mount point.
+ * Symlinks are only passed in with -L and are judged by their target.
+ */
+static int on_other_fs(DIR *dirp, const char *name, int is_link)
+{
+	struct stat st;
+	int flags = AT_NO_AUTOMOUNT;
+
+	if (!is_link)
+		flags |= AT_SYMLINK_NOFOLLOW;
+	throttle_op();
+	if (fstatat(dirfd(dirp), name, &st, flags) < 0)
+		return 0;
+
+	return st.st_dev != root_dev;
+}
+
+/*
+ * Resolve a DT_LNK entry for -L: return the d_type of the link target,
+ * or DT_UNKNOWN for dangling links and targets we do not care about.
+ */
+static int follow_link(DIR *dirp, const char *name)
+{
+	struct stat st;
+
+	throttle_op();
+	if (fstatat(dirfd(dirp), name, &st, 0) < 0)
+		return DT_UNKNOWN;
+	if (S_ISDIR(st.st_mode))
+		return DT_DIR;
+	if (S_ISREG(st.st_mode))
+		return DT_REG;
+	return DT_UNKNOWN;
+}
+
+/* Return the full path of node "i" in a new string. */
+static char *walk_path(uint32_t i)
+{
+	char *path;
+	size_t len = 0, n;
+	uint32_t j;
+
+	for (j = i; j != WALK_NONE; j = walk_nodes[j].parent) {
+		len += strlen(walk_names + walk_nodes[j].name);
+		if (walk_nodes[j].parent != WALK_NONE)
+			len++;
+	}
+	path = malloc(len + 1);
+	path[len] = '\0';
+	for (j = i; j != WALK_NONE; j = walk_nodes[j].parent) {
+		n = strlen(walk_names + walk_nodes[j].name);
+		len -= n;
+		memcpy(path + len, walk_names + walk_nodes[j].name, n);
+		if (walk_nodes[j].parent != WALK_NONE)
+			path[--len] = '/';
+	}
+
+	return path;
+}
+
+static void cost_index_grow(struct cost_index *idx)
+{
+	struct cost **old = idx->slots;
+	size_t old_size = old ? idx->mask + 1 : 0;
+	size_t size = old_size ? old_size * 2 : 1024;
+	size_t i, k;
+
+	idx->slots = calloc(size, sizeof(*idx->slots));
+	idx->mask = size - 1;
+	for (i = 0; i < old_size; i++) {
+		if (old[i] == NULL)
+			continue;
+		k = string_hash(old[i]->path) & idx->mask;
+		while (idx->slots[k] != NULL)
+			k = (k + 1) & idx->mask;
+		idx->slots[k] = old[i];
+	}
+	free(old);
+}
+
+/* Find the cost of "path", adding it if "create" is set. */
+static struct cost *cost_lookup(struct cost_index *idx, const char *path,
+				int create)
+{
+	size_t k;
+
+	if (idx->slots == NULL || idx->count * 2 >= idx->mask + 1)
+		cost_index_grow(idx);
+
+	k = string_hash(path) & idx->mask;
+	while (idx->slots[k] != NULL) {
+		if (!strcmp(idx->slots[k]->path, path))
+			return idx->slots[k];
+		k = (k + 1) & idx->mask;
+	}
+	if (!create)
+		return NULL;
+
+	idx->slots[k] = calloc(1, sizeof(struct cost));
+	idx->slots[k]->path = strdup(path);
+	idx->count++;
+	return idx->slots[k];
+}
+
+/* Load the costs of the previous scan, if there was one. */
+static void cost_load(void)
+{
+	FILE *fp;
+	char *line = NULL, *path;
+	size_t line_size = 0;
+	unsigned long long entries;
+	double secs;
+	struct cost *c;
+
+	if ((fp = fopen(opt_cost_file, "r")) == NULL)
+		return;
+	if (getline(&line, &line_size, fp) < 0 ||
+	    strcmp(line, COST_MAGIC "\n")) {
+		fprintf(stderr, "gitree: %s is not a cost file\n",
+			opt_cost_file);
+		exit(-1);
+	}
+
+	while (getdelim(&line, &line_size, '\0', fp) > 0) {
+		secs = strtod(line, &path);
+		entries = strtoull(path, &path, 10);
+		c = cost_lookup(&costs, path + 1, 1);
+		c->secs = secs;
+		c->entries = entries;
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Save the costs measured by this scan. Costs of the previous scan are
+ * kept for the subtrees this one did not finish, unless it covered the
+ * whole tree.
+ */
+static void cost_save(int complete)
+{
+	char *tmp;
+	FILE *fp;
+	size_t i;
+	struct cost *c;
+
+	tmp = malloc(strlen(opt_cost_file) + 5);
+	strcpy(tmp, opt_cost_file);
+	strcat(tmp, ".tmp");
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "gitree: cannot write cost file %s\n", tmp);
+		free(tmp);
+		return;
+	}
+
+	fprintf(fp, "%s\n", COST_MAGIC);
+	for (i = 0; costs.slots && i <= costs.mask; i++) {
+		c = costs.slots[i];
+		if (c && (c->measured || !complete))
+			fprintf(fp, "%.6f %llu %s%c", c->secs, c->entries,
+				c->path, '\0');
+	}
+
+	if (fclose(fp) || rename(tmp, opt_cost_file))
+		fprintf(stderr, "gitree: cannot write cost file %s\n",
+			opt_cost_file);
+	free(tmp);
+}
+
+/*
+ * The subtree at node "i" is finished: add its cost to its parent's and
+ * record it if it is big enough to be worth scheduling.
+ */
+static void cost_done(uint32_t i)
+{
+	struct walk_node *node = &walk_nodes[i];
+	struct cost *c;
+	char *path;
+
+	if (node->parent != WALK_NONE) {
+		walk_nodes[node->parent].secs += node->secs;
+		walk_nodes[node->parent].entries += node->entries;
+	}
+	if (node->entries < COST_MIN_ENTRIES && node->parent != WALK_NONE)
+		return;
+
+	path = walk_path(i);
+	c = cost_lookup(&costs, path, 1);
+	c->secs = node->secs;
+	c->entries = node->entries;
+	c->measured = 1;
+	free(path);
+}
+
+struct cost_order {
+	char *path;
+	double secs;
+	int i;
+};
+
+static int cost_order_cmp(const void *a, const void *b)
+{
+	const struct cost_order *x = a, *y = b;
+
+	if (x->secs != y->secs)
+		return x->secs < y->secs ? 1 : -1;
+	return x->i - y->i;
+}
+
+/*
+ * Order the "n" subdirectories by decreasing previous cost; those
+ * without one keep their order, after the others.
+ */
+static void cost_sort(char **subdir, int n)
+{
+	struct cost_order *order;
+	struct cost *c;
+	int i, known = 0;
+
+	order = malloc(n * sizeof(*order));
+	for (i = 0; i < n; i++) {
+		c = cost_lookup(&costs, subdir[i], 0);
+		order[i].path = subdir[i];
+		order[i].secs = c ? c->secs : -1;
+		order[i].i = i;
+		known += c != NULL;
+	}
+	if (known) {
+		qsort(order, n, sizeof(*order), cost_order_cmp);
+		for (i = 0; i < n; i++)
+			subdir[i] = order[i].path;
+	}
+	free(order);
+}
+
+struct ino_order {
+	char *path;
+	ino_t ino;
+};
+
+static int ino_order_cmp(const void *a, const void *b)
+{
+	const struct ino_order *x = a, *y = b;
+
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Order the "n" subdirectories by inode number. On most filesystems
+ * inodes are allocated in disk order, so the inode table is then read
+ * mostly sequentially instead of in readdir hash order.
+ */
+static void inode_sort(char **subdir, ino_t *ino, int n)
+{
+	struct ino_order *order;
+	int i;
+
+	order = malloc(n * sizeof(*order));
+	for (i = 0; i < n; i++) {
+		order[i].path = subdir[i];
+		order[i].ino = ino[i];
+	}
+	qsort(order, n, sizeof(*order), ino_order_cmp);
+	for (i = 0; i < n; i++)
+		subdir[i] = order[i].path;
+	free(order);
+}
+
+/* Move the names of the live nodes together, dropping freed ones. */
+static void walk_compact(void)
+{
+	char *names = malloc(walk_names_size);
+	size_t len = 0, n;
+	uint32_t i;
+
+	for (i = 0; i < walk_nodes_n; i++) {
+		if (walk_nodes[i].name == WALK_NONE)
+			continue;
+		n = strlen(walk_names + walk_nodes[i].name) + 1;
+		memcpy(names + len, walk_names + walk_nodes[i].name, n);
+		walk_nodes[i].name = len;
+		len += n;
+	}
+
+	free(walk_names);
+	walk_names = names;
+	walk_names_len = len;
+	walk_names_dead = 0;
+}
+
+static void fd_cache_unlink(uint32_t s)
+{
+	struct fd_slot *slot = &fd_cache.slots[s];
+
+	if (slot->prev != WALK_NONE)
+		fd_cache.slots[slot->prev].next = slot->next;
+	else
+		fd_cache.head = slot->next;
+	if (slot->next != WALK_NONE)
+		fd_cache.slots[slot->next].prev = slot->prev;
+	else
+		fd_cache.tail = slot->prev;
+}
+
+static void fd_cache_link(uint32_t s)
+{
+	fd_cache.slots[s].prev = WALK_NONE;
+	fd_cache.slots[s].next = fd_cache.head;
+	if (fd_cache.head != WALK_NONE)
+		fd_cache.slots[fd_cache.head].prev = s;
+	else
+		fd_cache.tail = s;
+	fd_cache.head = s;
+}
+
+/* The cached descriptor of node "i", or -1. */
+static int fd_cache_get(uint32_t i)
+{
+	uint32_t s = walk_nodes[i].fd;
+
+	if (s == WALK_NONE)
+		return -1;
+	fd_cache_unlink(s);
+	fd_cache_link(s);
+	return fd_cache.slots[s].fd;
+}
+
+/* Close the cached descriptor of node "i", if it has one. */
+static void fd_cache_forget(uint32_t i)
+{
+	uint32_t s = walk_nodes[i].fd;
+
+	if (s == WALK_NONE)
+		return;
+	close(fd_cache.slots[s].fd);
+	fd_cache_unlink(s);
+	fd_cache.slots[s].next = fd_cache.free;
+	fd_cache.free = s;
+	walk_nodes[i].fd = WALK_NONE;
+}
+
+/* Cache "fd" for node "i", closing the coldest descriptor when full. */
+static void fd_cache_put(uint32_t i, int fd)
+{
+	uint32_t s;
+
+	if (fd < 0)
+		return;
+	if (fd_cache.free == WALK_NONE)
+		fd_cache_forget(fd_cache.slots[fd_cache.tail].node);
+	s = fd_cache.free;
+	fd_cache.free = fd_cache.slots[s].next;
+	fd_cache.slots[s].fd = fd;
+	fd_cache.slots[s].node = i;
+	walk_nodes[i].fd = s;
+	fd_cache_link(s);
+}
+
+/*
+ * Raise the soft limit on open files to the hard limit, and keep the
+ * cache within half of it so the workers still have descriptors left.
+ */
+static void fd_cache_init(void)
+{
+	struct rlimit rl;
+	int i;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		if (rl.rlim_cur < rl.rlim_max) {
+			rl.rlim_cur = rl.rlim_max;
+			/* an unlimited hard limit may be above nr_open */
+			if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+				getrlimit(RLIMIT_NOFILE, &rl);
+		}
+		if (opt_fd_budget < 0)
+			opt_fd_budget = FD_BUDGET;
+		if (rl.rlim_cur != RLIM_INFINITY &&
+		    (rlim_t)opt_fd_budget > rl.rlim_cur / 2)
+			opt_fd_budget = rl.rlim_cur / 2;
+	}
+	if (opt_fd_budget <= 0) {
+		opt_fd_budget = 0;
+		return;
+	}
+
+	fd_cache.slots = calloc(opt_fd_budget, sizeof(*fd_cache.slots));
+	for (i = opt_fd_budget - 1; i >= 0; i--) {
+		fd_cache.slots[i].next = fd_cache.free;
+		fd_cache.free = i;
+	}
+}
+
+/* Add directory "name" under node "parent" to the pending nodes. */
+static void walk_push(uint32_t parent, const char *name, double weight)
+{
+	size_t len = strlen(name) + 1, old;
+	uint32_t i;
+
+	if (walk_names_len + len > walk_names_size &&
+	    walk_names_dead > walk_names_len / 2)
+		walk_compact();
+	if (walk_names_len + len > walk_names_size) {
+		walk_names_size = (walk_names_size + len) * 2;
+		walk_names = realloc(walk_names, walk_names_size);
+	}
+
+	if (walk_free != WALK_NONE) {
+		i = walk_free;
+		walk_free = walk_nodes[i].parent;
+	} else {
+		if (walk_nodes_n == walk_nodes_size) {
+			walk_nodes_size = walk_nodes_size ?
+					  walk_nodes_size * 2 : 256;
+			walk_nodes = realloc(walk_nodes, walk_nodes_size *
+					     sizeof(*walk_nodes));
+		}
+		i = walk_nodes_n++;
+	}
+	walk_nodes[i].parent = parent;
+	walk_nodes[i].name = walk_names_len;
+	walk_nodes[i].refs = 1;
+	walk_nodes[i].inv = INV_NONE;
+	walk_nodes[i].fd = WALK_NONE;
+	walk_nodes[i].weight = weight;
+	walk_nodes[i].secs = 0;
+	walk_nodes[i].entries = 0;
+	memcpy(walk_names + walk_names_len, name, len);
+	walk_names_len += len;
+	if (parent != WALK_NONE)
+		walk_nodes[parent].refs++;
+
+	if (walk_len == walk_size) {
+		old = walk_size;
+		walk_size = walk_size ? walk_size * 2 : 256;
+		walk_deque = realloc(walk_deque,
+				     walk_size * sizeof(*walk_deque));
+		/* unwrap the part that wrapped around */
+		if (walk_head + walk_len > old)
+			memcpy(walk_deque + old, walk_deque,
+			       (walk_head + walk_len - old) *
+			       sizeof(*walk_deque));
+	}
+	walk_deque[(walk_head + walk_len++) % walk_size] = i;
+}
+
+/*
+ * Push the "n" subdirectories of node "parent" in the order that has
+ * the first of them scanned first. They weigh "weight" each, unless
+ * "weights" has a weight per subdirectory.
+ */
+static void walk_push_list(uint32_t parent, char **names, int n,
+			   double weight, double *weights)
+{
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		k = opt_bfs ? i : n - 1 - i;
+		walk_push(parent, names[k], weights ? weights[k] : weight);
+	}
+}
+
+/* Return the pending node that is "k"-th in scan order. */
+static uint32_t walk_pending(size_t k)
+{
+	if (opt_bfs && walk_len < (size_t)opt_bfs)
+		return walk_deque[(walk_head + k) % walk_size];
+	return walk_deque[(walk_head + walk_len - 1 - k) % walk_size];
+}
+
+static uint32_t walk_take(void)
+{
+	uint32_t i = walk_pending(0);
+
+	if (opt_bfs && walk_len < (size_t)opt_bfs)
+		walk_head = (walk_head + 1) % walk_size;
+	walk_len--;
+	return i;
+}
+
+/*
+ * Drop a reference to node "i": once it is scanned and none of its
+ * subdirectories is pending, the node and its name are freed, which may
+ * in turn release its parent.
+ */
+static void walk_release(uint32_t i)
+{
+	uint32_t parent;
+	size_t len;
+
+	while (i != WALK_NONE && --walk_nodes[i].refs == 0) {
+		if (opt_cost_file)
+			cost_done(i);
+		fd_cache_forget(i);
+		parent = walk_nodes[i].parent;
+		len = strlen(walk_names + walk_nodes[i].name) + 1;
+		/* depth first, names are freed in reverse order */
+		if (walk_nodes[i].name + len == walk_names_len)
+			walk_names_len = walk_nodes[i].name;
+		else
+			walk_names_dead += len;
+		walk_nodes[i].name = WALK_NONE;
+		walk_nodes[i].parent = walk_free;
+		walk_free = i;
+		i = parent;
+	}
+}
+
+/* Return the inventory record of the parent of the directory scanned. */
+static uint32_t walk_inv_parent(void)
+{
+	uint32_t parent = walk_nodes[walk_current].parent;
+
+	return parent == WALK_NONE ? INV_NONE : walk_nodes[parent].inv;
+}
+
+/*
+ * Collect the paths and weights of the pending directories in scan
+ * order. Returns the number of entries; the paths are new strings.
+ */
+static int collect_pending(char ***paths, double **weights)
+{
+	size_t k;
+	uint32_t i;
+
+	*paths = malloc((walk_len + 1) * sizeof(**paths));
+	*weights = malloc((walk_len + 1) * sizeof(**weights));
+	for (k = 0; k < walk_len; k++) {
+		i = walk_pending(k);
+		(*paths)[k] = walk_path(i);
+		(*weights)[k] = walk_nodes[i].weight;
+	}
+
+	return walk_len;
+}
+
+/*
+ * Options that change what a scan reports. A checkpoint records them and
+ * a resume has to run with the same values, or its report would not be
+ * the one an uninterrupted scan writes.
+ */
+static const struct {
+	const char *name;
+	int *value;
+} scan_options[] = {
+	{ "one-file-system",	&opt_one_file_system },
+	{ "follow",		&opt_follow },
+	{ "du",			&opt_du },
+	{ "top",		&opt_top },
+	{ "dup-packs",		&opt_dup_packs },
+	{ "locks",		&opt_locks },
+	{ "lock-age",		&opt_lock_age },
+	{ "garbage",		&opt_garbage },
+	{ "garbage-age",	&opt_garbage_age },
+	{ "verify",		&opt_verify },
+	{ "verify-sample",	&opt_verify_sample },
+	{ "idle-days",		&opt_idle_days },
+	{ "sort",		&opt_sort },
+	{ "inode-order",	&opt_inode_order },
+	{ "summary",		&opt_summary },
+	{ "aggregate",		&opt_aggregate },
+	{ "aggregate-samples",	&opt_aggregate_samples },
+};
+
+static int scan_options_size = sizeof(scan_options) / sizeof(scan_options[0]);
+
+/*
+ * Write the checkpoint of the pending directories, the next one to be
+ * scanned first. The file is replaced atomically, and stdout is synced
+ * first so the recorded offset never points past data that made it to
+ * disk.
+ */
+static void write_checkpoint(void)
+{
+	char *tmp, **paths;
+	double *weights;
+	FILE *fp;
+	off_t offset;
+	int i, pending;
+	size_t k;
+
+	fflush(stdout);
+	offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+	if (offset >= 0)
+		fdatasync(STDOUT_FILENO);
+
+	tmp = malloc(strlen(opt_checkpoint) + 5);
+	strcpy(tmp, opt_checkpoint);
+	strcat(tmp, ".tmp");
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "gitree: cannot write checkpoint %s\n", tmp);
+		free(tmp);
+		return;
+	}
+
+	pending = collect_pending(&paths, &weights);
+	fprintf(fp, "%s\n", CHECKPOINT_MAGIC);
+	fprintf(fp, "offset %lld\n", (long long)offset);
+	for (i = 0; i < scan_options_size; i++)
+		fprintf(fp, "option %s %d\n", scan_options[i].name,
+			*scan_options[i].value);
+	for (i = 0; i < counters_array_size; i++)
+		fprintf(fp, "%s %d\n", counters[i].name, *counters[i].value);
+	for (i = 0; i < totals_array_size; i++)
+		fprintf(fp, "%s %llu\n", totals[i].name, *totals[i].value);
+	/* with -L, the directories already reached through another path */
+	fprintf(fp, "visited %zu\n", visited.count);
+	for (k = 0; visited.slots && k <= visited.mask; k++)
+		if (visited.slots[k].ino != 0)
+			fprintf(fp, "%llu %llu\n",
+				(unsigned long long)visited.slots[k].dev,
+				(unsigned long long)visited.slots[k].ino);
+	fprintf(fp, "pending %d\n", pending);
+	for (i = 0; i < pending; i++) {
+		fprintf(fp, "%.17g %s%c", weights[i], paths[i], '\0');
+		free(paths[i]);
+	}
+	free(paths);
+	free(weights);
+
+	if (fflush(fp) || fsync(fileno(fp)) || fclose(fp) ||
+	    rename(tmp, opt_checkpoint))
+		fprintf(stderr, "gitree: cannot write checkpoint %s\n",
+			opt_checkpoint);
+	free(tmp);
+}
+
+/*
+ * Load a checkpoint written by write_checkpoint(): restore the counters,
+ * cut stdout back to the recorded offset and return the pending
+ * directories in scan order, along with their weights.
+ */
+static char **read_checkpoint(char *file, int *pending, double **weights)
+{
+	FILE *fp;
+	char *line = NULL, **subdir, *path;
+	size_t line_size = 0;
+	long long offset = -1;
+	char name[64];
+	unsigned long long value, dev, ino;
+	int i, option;
+	size_t k, nvisited;
+	struct stat st;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "gitree: cannot open checkpoint %s\n", file);
+		exit(-1);
+	}
+
+	if (getline(&line, &line_size, fp) < 0 ||
+	    strcmp(line, CHECKPOINT_MAGIC "\n")) {
+		if (line && !strncmp(line, "gitree-checkpoint ", 18))
+			fprintf(stderr, "gitree: checkpoint %s has an older "
+				"format, start a new scan\n", file);
+		else
+			fprintf(stderr, "gitree: %s is not a checkpoint\n",
+				file);
+		exit(-1);
+	}
+
+	*pending = -1;
+	while (*pending < 0 && getline(&line, &line_size, fp) > 0) {
+		if (sscanf(line, "offset %lld", &offset) == 1)
+			continue;
+		if (sscanf(line, "pending %d", pending) == 1)
+			continue;
+		if (sscanf(line, "option %63s %d", name, &option) == 2) {
+			for (i = 0; i < scan_options_size; i++)
+				if (!strcmp(name, scan_options[i].name) &&
+				    *scan_options[i].value != option) {
+					fprintf(stderr, "gitree: checkpoint %s "
+						"was written with --%s %d, "
+						"not %d\n", file, name, option,
+						*scan_options[i].value);
+					exit(-1);
+				}
+			continue;
+		}
+		if (sscanf(line, "visited %zu", &nvisited) == 1) {
+			for (k = 0; k < nvisited; k++) {
+				if (getline(&line, &line_size, fp) <= 0 ||
+				    sscanf(line, "%llu %llu", &dev, &ino) != 2)
+					break;
+				devino_set_insert(&visited, dev, ino);
+			}
+			continue;
+		}
+		if (sscanf(line, "%63s %llu", name, &value) != 2)
+			continue;
+		for (i = 0; i < counters_array_size; i++)
+			if (!strcmp(name, counters[i].name))
+				*counters[i].value = value;
+		for (i = 0; i < totals_array_size; i++)
+			if (!strcmp(name, totals[i].name))
+				*totals[i].value = value;
+	}
+	if (*pending < 0) {
+		fprintf(stderr, "gitree: checkpoint %s is truncated\n", file);
+		exit(-1);
+	}
+
+	subdir = malloc((*pending + 1) * sizeof(*subdir));
+	*weights = malloc((*pending + 1) * sizeof(**weights));
+	for (i = 0; i < *pending; i++) {
+		if (getdelim(&line, &line_size, '\0', fp) <= 0) {
+			fprintf(stderr, "gitree: checkpoint %s is truncated\n",
+				file);
+			exit(-1);
+		}
+		(*weights)[i] = strtod(line, &path);
+		subdir[i] = strdup(path + 1);
+	}
+	free(line);
+	fclose(fp);
+
+	if (offset >= 0 && fstat(STDOUT_FILENO, &st) == 0 &&
+	    S_ISREG(st.st_mode)) {
+		if (st.st_size < offset)
+			fprintf(stderr, "gitree: report is shorter than "
+				"checkpoint offset %lld\n", offset);
+		else if (ftruncate(STDOUT_FILENO, offset) < 0 ||
+			 lseek(STDOUT_FILENO, offset, SEEK_SET) < 0)
+			fprintf(stderr, "gitree: cannot rewind report\n");
+	}
+
+	return subdir;
+}
+
+/*
+ * A directory that cannot be read is a finding like any other: report
+ * it, count it and let the scan go on with the rest of the tree.
+ */
+static void report_error(const char *dirname, int err)
+{
+	__atomic_fetch_add(&sum_errors, 1, __ATOMIC_RELAXED);
+	fprintf(out, "ERROR: %s: %s (errno %d)\n", dirname, strerror(err),
+		err);
+}
+
+/*
+ * opendir() with a bounded retry for the errors a busy or failing-over
+ * NFS server hands out transiently. Backs off 100ms, 200ms, 400ms...
+ * Leaves reporting a failure to the caller.
+ */
+static DIR *opendir_try(const char *dirname)
+{
+	DIR *dirp;
+	int retry;
+	useconds_t delay = 100000;
+
+	bucket_take(&dir_bucket);
+	for (retry = 0; ; retry++) {
+		throttle_op();
+		if ((dirp = opendir(dirname)) != NULL)
+			return dirp;
+		if ((errno != ESTALE && errno != EIO) || retry >= opt_retries)
+			break;
+		throttle_sleep(delay / 1e6);
+		delay *= 2;
+	}
+
+	return NULL;
+}
+
+static DIR *opendir_retry(const char *dirname)
+{
+	DIR *dirp;
+
+	if ((dirp = opendir_try(dirname)) == NULL)
+		report_error(dirname, errno);
+	return dirp;
+}
+
+/*
+ * opendir_retry() for the directory being walked, relative to its
+ * parent's cached descriptor when there is one.
+ */
+static DIR *opendir_walk(const char *dirname)
+{
+	uint32_t parent = walk_nodes[walk_current].parent;
+	const char *name = walk_names + walk_nodes[walk_current].name;
+	DIR *dirp;
+	int fd, pfd, retry;
+	useconds_t delay = 100000;
+
+	bucket_take(&dir_bucket);
+	for (retry = 0; ; retry++) {
+		throttle_op();
+		pfd = parent != WALK_NONE ? fd_cache_get(parent) : -1;
+		if (pfd >= 0)
+			fd = openat(pfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		else
+			fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd >= 0) {
+			if ((dirp = fdopendir(fd)) != NULL)
+				return dirp;
+			close(fd);
+			errno = ENOMEM;
+		}
+		if ((errno != ESTALE && errno != EIO) || retry >= opt_retries)
+			break;
+		/* it may be the parent's handle that went stale */
+		if (pfd >= 0)
+			fd_cache_forget(parent);
+		throttle_sleep(delay / 1e6);
+		delay *= 2;
+	}
+
+	report_error(dirname, errno);
+	return NULL;
+}
+
+/* readdir() that reports a failure instead of mistaking it for EOF */
+static struct dirent *read_entry(DIR *dirp, const char *dirname)
+{
+	struct dirent *direntp;
+	int err;
+
+	errno = 0;
+	if ((direntp = readdir(dirp)) == NULL) {
+		err = errno;
+		if (err != 0)
+			report_error(dirname, err);
+		errno = err;	/* for the caller to tell an error from the end */
+		return NULL;
+	}
+
+	return direntp;
+}
+
+static void du_add(struct du_batch *b, const char *dirname,
+		   const char *name, int is_dir)
+{
+	size_t len = strlen(dirname) + 1 + strlen(name) + 1;
+	struct du_item *item;
+
+	if (b->arena_len + len > b->arena_size) {
+		b->arena_size = (b->arena_size + len) * 2;
+		b->arena = realloc(b->arena, b->arena_size);
+	}
+	if (b->items == NULL)
+		b->items = malloc(DU_BATCH * sizeof(*b->items));
+
+	item = &b->items[b->n++];
+	item->path = b->arena_len;
+	item->is_dir = is_dir;
+	b->arena_len += sprintf(b->arena + b->arena_len, "%s/%s",
+				dirname, name) + 1;
+}
+
+static void du_stat_one(void *arg, size_t i)
+{
+	struct du_batch *b = arg;
+	struct du_item *item = &b->items[i];
+	struct statx stx;
+
+	throttle_op();
+	if (statx(AT_FDCWD, b->arena + item->path,
+		  AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+		  STATX_SIZE | STATX_BLOCKS | STATX_NLINK | STATX_INO,
+		  &stx) < 0) {
+		item->err = errno;
+		return;
+	}
+	item->err = 0;
+	item->size = stx.stx_size;
+	item->alloc = stx.stx_blocks * 512;
+	item->nlink = stx.stx_nlink;
+	item->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	item->ino = stx.stx_ino;
+}
+
+/*
+ * statx() the whole batch in parallel, then add it up serially so the
+ * hardlink set needs no locking.
+ */
+static void du_flush(struct du_batch *b)
+{
+	struct du_item *item;
+	size_t i;
+
+	if (b->n < POOL_MIN_BATCH)
+		for (i = 0; i < b->n; i++)
+			du_stat_one(b, i);
+	else
+		pool_run(b->n, du_stat_one, b);
+
+	pthread_mutex_lock(&hardlinks_lock);
+	for (i = 0; i < b->n; i++) {
+		item = &b->items[i];
+		if (item->err)
+			continue;
+		if (!item->is_dir && item->nlink > 1 && b->defer_links) {
+			if (b->nlinks == b->links_size) {
+				b->links_size = b->links_size ?
+					b->links_size * 2 : 64;
+				b->links = realloc(b->links, b->links_size *
+						   sizeof(*b->links));
+				if (b->links == NULL) {
+					fprintf(stderr, "ERROR: gitree: "
+						"out of memory\n");
+					exit(-1);
+				}
+			}
+			b->links[b->nlinks++] = (struct du_link) {
+				item->dev, item->ino, item->size, item->alloc
+			};
+			continue;
+		}
+		if (!item->is_dir && item->nlink > 1 &&
+		    !devino_set_insert(&hardlinks, item->dev, item->ino))
+			continue;
+		b->size += item->size;
+		b->alloc += item->alloc;
+	}
+	pthread_mutex_unlock(&hardlinks_lock);
+
+	b->n = 0;
+	b->arena_len = 0;
+}
+
+static void du_free(struct du_batch *b)
+{
+	free(b->arena);
+	free(b->items);
+}
+
+/* Queue everything below "dirname" for statx(), the directory included. */
+static void du_walk(struct du_batch *b, const char *dirname)
+{
+	DIR *dirp;
+	struct dirent *direntp;
+	char *path;
+
+	du_add(b, dirname, ".", 1);
+	if (b->n == DU_BATCH)
+		du_flush(b);
+
+	if ((dirp = opendir_retry(dirname)) == NULL)
+		return;
+
+	while ((direntp = read_entry(dirp, dirname)) != NULL) {
+		if (!strcmp(direntp->d_name, "."))
+			continue;
+		else if (!strcmp(direntp->d_name, ".."))
+			continue;
+		if (direntp->d_type == DT_DIR) {
+			path = malloc(strlen(dirname) +
+				      strlen(direntp->d_name) + 2);
+			sprintf(path, "%s/%s", dirname, direntp->d_name);
+			du_walk(b, path);
+			free(path);
+		} else {
+			du_add(b, dirname, direntp->d_name, 0);
+			if (b->n == DU_BATCH)
+				du_flush(b);
+		}
+	}
+
+	closedir(dirp);
+}
+
+/* Keep the heap's opt_top largest entries by allocated size. */
+static void du_heap_push(struct du_heap *h, const char *path,
+			 unsigned long long size, unsigned long long alloc)
+{
+	struct du_entry tmp;
+	int i, child;
+
+	if (opt_top <= 0)
+		return;
+	if (h->e == NULL)
+		h->e = calloc(opt_top, sizeof(*h->e));
+
+	if (h->n < opt_top) {
+		i = h->n++;
+		h->e[i].path = strdup(path);
+		h->e[i].size = size;
+		h->e[i].alloc = alloc;
+		/* sift up */
+		while (i > 0 && h->e[(i - 1) / 2].alloc > h->e[i].alloc) {
+			tmp = h->e[i];
+			h->e[i] = h->e[(i - 1) / 2];
+			h->e[(i - 1) / 2] = tmp;
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+
+	if (alloc <= h->e[0].alloc)
+		return;
+
+	free(h->e[0].path);
+	h->e[0].path = strdup(path);
+	h->e[0].size = size;
+	h->e[0].alloc = alloc;
+	/* sift down */
+	for (i = 0; (child = 2 * i + 1) < h->n; i = child) {
+		if (child + 1 < h->n && h->e[child + 1].alloc < h->e[child].alloc)
+			child++;
+		if (h->e[i].alloc <= h->e[child].alloc)
+			break;
+		tmp = h->e[i];
+		h->e[i] = h->e[child];
+		h->e[child] = tmp;
+	}
+}
+
+static int du_entry_cmp(const void *a, const void *b)
+{
+	const struct du_entry *x = a, *y = b;
+
+	if (x->alloc != y->alloc)
+		return x->alloc < y->alloc ? 1 : -1;
+	return strcmp(x->path, y->path);
+}
+
+static void du_heap_print(struct du_heap *h, const char *title)
+{
+	int i;
+
+	if (h->n == 0)
+		return;
+	qsort(h->e, h->n, sizeof(*h->e), du_entry_cmp);
+	printf("\n%s:\n", title);
+	for (i = 0; i < h->n; i++)
+		printf("%llu bytes (%llu allocated) %s\n",
+		       h->e[i].size, h->e[i].alloc, h->e[i].path);
+}
+
+static void du_repo(char *dirname)
+{
+	struct du_batch b = { .defer_links = 1 };
+
+	du_walk(&b, dirname);
+	du_flush(&b);
+	du_free(&b);
+
+	tally.repo_bytes += b.size;
+	tally.repo_alloc += b.alloc;
+	tally.links = b.links;
+	tally.nlinks = b.nlinks;
+}
+
+/*
+ * Charge a repo for the hardlinked files no earlier repo had, then
+ * report its size. Runs in report order.
+ */
+static void du_repo_done(char *dirname, struct tally *t)
+{
+	struct du_link *l;
+	size_t i;
+
+	pthread_mutex_lock(&hardlinks_lock);
+	for (i = 0; i < t->nlinks; i++) {
+		l = &t->links[i];
+		if (!devino_set_insert(&hardlinks, l->dev, l->ino))
+			continue;
+		t->repo_bytes += l->size;
+		t->repo_alloc += l->alloc;
+	}
+	pthread_mutex_unlock(&hardlinks_lock);
+	free(t->links);
+
+	du_repo_bytes += t->repo_bytes;
+	du_repo_alloc += t->repo_alloc;
+	du_heap_push(&top_repos, dirname, t->repo_bytes, t->repo_alloc);
+	report("SIZE: %s %llu bytes (%llu allocated)\n",
+	       dirname, t->repo_bytes, t->repo_alloc);
+}
+
+/*
+ * Account the files not in a git tree of "dirname", added to "b" while
+ * the directory was read, and return their size.
+ */
+static unsigned long long du_stray(char *dirname, struct du_batch *b)
+{
+	du_flush(b);
+	du_free(b);
+
+	du_stray_bytes += b->size;
+	du_stray_alloc += b->alloc;
+	du_heap_push(&top_strays, dirname, b->size, b->alloc);
+	report("SIZE: %s %llu bytes (%llu allocated) not in a git tree\n",
+	       dirname, b->size, b->alloc);
+	return b->size;
+}
+
+static void pack_index_grow(struct pack_index *idx)
+{
+	struct pack **old = idx->slots;
+	size_t old_size = old ? idx->mask + 1 : 0;
+	size_t size = old_size ? old_size * 2 : 1024;
+	size_t i, k;
+
+	idx->slots = calloc(size, sizeof(*idx->slots));
+	idx->mask = size - 1;
+	for (i = 0; i < old_size; i++) {
+		if (old[i] == NULL)
+			continue;
+		k = string_hash(old[i]->name) & idx->mask;
+		while (idx->slots[k] != NULL)
+			k = (k + 1) & idx->mask;
+		idx->slots[k] = old[i];
+	}
+	free(old);
+}
+
+static struct pack *pack_lookup(struct pack_index *idx, const char *name,
+				unsigned long long size)
+{
+	size_t k;
+
+	if (idx->slots == NULL || idx->count * 2 >= idx->mask + 1)
+		pack_index_grow(idx);
+
+	k = string_hash(name) & idx->mask;
+	while (idx->slots[k] != NULL) {
+		if (!strcmp(idx->slots[k]->name, name))
+			return idx->slots[k];
+		k = (k + 1) & idx->mask;
+	}
+
+	idx->slots[k] = calloc(1, sizeof(struct pack));
+	idx->slots[k]->name = strdup(name);
+	idx->slots[k]->size = size;
+	idx->count++;
+	return idx->slots[k];
+}
+
+/* Record the packs of the repo at "dirname" in the pack index. */
+static void index_packs(char *dirname)
+{
+	char *path;
+	DIR *dirp;
+	struct dirent *direntp;
+	struct stat st;
+	struct pack *pack;
+	struct pack_copy *copy;
+	char *name;
+	size_t len;
+	int repo = -1;
+
+	path = malloc(strlen(dirname) + sizeof("/objects/pack"));
+	sprintf(path, "%s/objects/pack", dirname);
+	if ((dirp = opendir_try(path)) == NULL) {
+		if (errno != ENOENT)
+			report_error(path, errno);
+		free(path);
+		return;
+	}
+
+	while ((direntp = read_entry(dirp, path)) != NULL) {
+		name = direntp->d_name;
+		len = strlen(name);
+		if (len <= 10 || strncmp(name, "pack-", 5) ||
+		    strcmp(name + len - 5, ".pack"))
+			continue;
+		throttle_op();
+		if (fstatat(dirfd(dirp), name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+		    !S_ISREG(st.st_mode))
+			continue;
+
+		pthread_mutex_lock(&packs_lock);
+		if (repo < 0) {
+			if (pack_repos_n == pack_repos_size) {
+				pack_repos_size = pack_repos_size * 2 + 64;
+				pack_repos = realloc(pack_repos,
+					pack_repos_size * sizeof(*pack_repos));
+				pack_repo_bytes = realloc(pack_repo_bytes,
+					pack_repos_size *
+					sizeof(*pack_repo_bytes));
+			}
+			repo = pack_repos_n++;
+			pack_repos[repo] = strdup(dirname);
+			pack_repo_bytes[repo] = 0;
+		}
+		pack_repo_bytes[repo] += st.st_size;
+
+		name[len - 5] = '\0';
+		pack = pack_lookup(&packs, name + 5, st.st_size);
+		pack->copies = realloc(pack->copies,
+			(pack->ncopies + 1) * sizeof(*pack->copies));
+		copy = &pack->copies[pack->ncopies++];
+		copy->repo = repo;
+		copy->dev = st.st_dev;
+		copy->ino = st.st_ino;
+		pthread_mutex_unlock(&packs_lock);
+	}
+
+	closedir(dirp);
+	free(path);
+}
+
+static int pack_copy_cmp(const void *a, const void *b)
+{
+	const struct pack_copy *x = a, *y = b;
+
+	if (x->dev != y->dev)
+		return x->dev < y->dev ? -1 : 1;
+	if (x->ino != y->ino)
+		return x->ino < y->ino ? -1 : 1;
+	return 0;
+}
+
+/* bytes a pack would give back if all its copies shared one inode */
+static unsigned long long pack_reclaimable(const struct pack *p)
+{
+	return (p->distinct - 1) * p->size;
+}
+
+static int dup_pack_cmp(const void *a, const void *b)
+{
+	const struct pack *x = *(struct pack **)a, *y = *(struct pack **)b;
+
+	if (pack_reclaimable(x) != pack_reclaimable(y))
+		return pack_reclaimable(x) < pack_reclaimable(y) ? 1 : -1;
+	return strcmp(x->name, y->name);
+}
+
+static int repo_pair_cmp(const void *a, const void *b)
+{
+	const struct repo_pair *x = a, *y = b;
+
+	if (x->shared != y->shared)
+		return x->shared < y->shared ? 1 : -1;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/* Add "bytes" to the pair (a, b) in an open-addressing table of pairs. */
+static void repo_pair_add(struct repo_pair **pairs, size_t *mask,
+			  size_t *count, int a, int b,
+			  unsigned long long bytes)
+{
+	struct repo_pair *old = *pairs;
+	size_t old_size = old ? *mask + 1 : 0;
+	uint64_t key;
+	size_t i, k;
+
+	if (old == NULL || *count * 2 >= *mask + 1) {
+		*mask = old_size ? old_size * 2 - 1 : 1023;
+		*pairs = calloc(*mask + 1, sizeof(**pairs));
+		for (i = 0; i < old_size; i++) {
+			if (!old[i].used)
+				continue;
+			k = devino_hash(0, old[i].key) & *mask;
+			while ((*pairs)[k].used)
+				k = (k + 1) & *mask;
+			(*pairs)[k] = old[i];
+		}
+		free(old);
+	}
+
+	if (a > b) {
+		i = a;
+		a = b;
+		b = i;
+	}
+	key = (uint64_t)a << 32 | (uint32_t)b;
+	k = devino_hash(0, key) & *mask;
+	while ((*pairs)[k].used && (*pairs)[k].key != key)
+		k = (k + 1) & *mask;
+	if (!(*pairs)[k].used) {
+		(*pairs)[k].key = key;
+		(*pairs)[k].used = 1;
+		(*count)++;
+	}
+	(*pairs)[k].shared += bytes;
+}
+
+static void report_dup_packs(void)
+{
+	struct pack **dups = NULL, *p;
+	struct repo_pair *pairs = NULL;
+	size_t mask = 0, npairs = 0, i, n = 0;
+	unsigned long long reclaimable = 0, smaller;
+	int a, b, c, ncopies;
+
+	for (i = 0; packs.slots && i <= packs.mask; i++) {
+		p = packs.slots[i];
+		if (p == NULL || p->ncopies < 2)
+			continue;
+
+		qsort(p->copies, p->ncopies, sizeof(*p->copies),
+		      pack_copy_cmp);
+		p->distinct = 1;
+		for (c = 1; c < p->ncopies; c++)
+			if (pack_copy_cmp(&p->copies[c - 1], &p->copies[c]))
+				p->distinct++;
+
+		ncopies = p->ncopies < PAIR_COPIES_MAX ?
+			  p->ncopies : PAIR_COPIES_MAX;
+		for (a = 0; a < ncopies; a++)
+			for (b = a + 1; b < ncopies; b++)
+				if (p->copies[a].repo != p->copies[b].repo)
+					repo_pair_add(&pairs, &mask, &npairs,
+						      p->copies[a].repo,
+						      p->copies[b].repo,
+						      p->size);
+
+		if (p->distinct < 2)
+			continue;
+		reclaimable += pack_reclaimable(p);
+		dups = realloc(dups, (n + 1) * sizeof(*dups));
+		dups[n++] = p;
+	}
+
+	printf("\nDuplicate packs:\n"
+	       "%zu packs stored more than once, "
+	       "%llu bytes reclaimable with alternates or hardlinks\n",
+	       n, reclaimable);
+	if (n > 0)
+		qsort(dups, n, sizeof(*dups), dup_pack_cmp);
+	for (i = 0; i < n && (int)i < opt_top; i++) {
+		p = dups[i];
+		printf("pack-%s.pack %llu bytes, %d copies:",
+		       p->name, p->size, p->distinct);
+		for (c = 0; c < p->ncopies; c++)
+			if (c == 0 || pack_copy_cmp(&p->copies[c - 1],
+						    &p->copies[c]))
+				printf(" %s", pack_repos[p->copies[c].repo]);
+		printf("\n");
+	}
+	free(dups);
+
+	/* compact the pair table and list the pairs sharing the most */
+	n = 0;
+	for (i = 0; pairs && i <= mask; i++)
+		if (pairs[i].used)
+			pairs[n++] = pairs[i];
+	if (n > 0)
+		qsort(pairs, n, sizeof(*pairs), repo_pair_cmp);
+	printf("\nNear-duplicate repos:\n");
+	for (i = 0; i < n && (int)i < opt_top; i++) {
+		a = pairs[i].key >> 32;
+		b = pairs[i].key & 0xffffffff;
+		smaller = pack_repo_bytes[a] < pack_repo_bytes[b] ?
+			  pack_repo_bytes[a] : pack_repo_bytes[b];
+		printf("%llu bytes shared (%.0f%% of the smaller) %s %s\n",
+		       pairs[i].shared,
+		       smaller ? pairs[i].shared * 100.0 / smaller : 0.0,
+		       pack_repos[a], pack_repos[b]);
+	}
+	free(pairs);
+}
+
+static int is_lock_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	if (!strcmp(name, "gc.pid"))
+		return 1;
+	return len > 5 && !strcmp(name + len - 5, ".lock");
+}
+
+/*
+ * Return the age of lock file "name" under "dfd" if it is stale, -1
+ * otherwise.
+ */
+static long stale_lock_age(struct lock_walk *w, int dfd, const char *name)
+{
+	struct stat st;
+	long age;
+
+	if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	age = w->now - st.st_mtime;
+	return age >= opt_lock_age ? age : -1;
+}
+
+static void lock_found(struct lock_walk *w, const char *dirname,
+		       const char *name, long age)
+{
+	char buf[32];
+	char *line;
+
+	format_duration(buf, sizeof(buf), age);
+	line = malloc(strlen(dirname) + strlen(name) + strlen(buf) + 8);
+	sprintf(line, "%s/%s %s old", dirname, name, buf);
+	w->found = realloc(w->found, (w->nfound + 1) * sizeof(*w->found));
+	w->found[w->nfound++] = line;
+}
+
+/*
+ * Look for stale locks in "dirname". With "subdirs" set, directories are
+ * returned there for the caller to hand out; otherwise they are searched
+ * recursively.
+ */
+static void lock_walk_dir(struct lock_walk *w, const char *dirname,
+			  char ***subdirs, int *nsubdirs)
+{
+	DIR *dirp;
+	struct dirent *direntp;
+	char *path;
+	long age;
+
+	if ((dirp = opendir_retry(dirname)) == NULL)
+		return;
+
+	while ((direntp = read_entry(dirp, dirname)) != NULL) {
+		if (!strcmp(direntp->d_name, "."))
+			continue;
+		else if (!strcmp(direntp->d_name, ".."))
+			continue;
+		if (direntp->d_type == DT_DIR) {
+			path = malloc(strlen(dirname) +
+				      strlen(direntp->d_name) + 2);
+			sprintf(path, "%s/%s", dirname, direntp->d_name);
+			if (subdirs) {
+				*subdirs = realloc(*subdirs, (*nsubdirs + 1) *
+						   sizeof(**subdirs));
+				(*subdirs)[(*nsubdirs)++] = path;
+			} else {
+				lock_walk_dir(w, path, NULL, NULL);
+				free(path);
+			}
+		} else if (is_lock_name(direntp->d_name)) {
+			age = stale_lock_age(w, dirfd(dirp), direntp->d_name);
+			if (age >= 0)
+				lock_found(w, dirname, direntp->d_name, age);
+		}
+	}
+
+	closedir(dirp);
+}
+
+static void lock_walk_one(void *arg, size_t i)
+{
+	struct lock_walk *w = (struct lock_walk *)arg + i;
+
+	lock_walk_dir(w, w->dirname, NULL, NULL);
+}
+
+static void print_locks(struct lock_walk *w)
+{
+	int i;
+
+	if (opt_sort && w->nfound > 0)
+		qsort(w->found, w->nfound, sizeof(*w->found), str_cmp);
+	for (i = 0; i < w->nfound; i++) {
+		tally.stale_locks++;
+		report("STALE LOCK: %s\n", w->found[i]);
+		free(w->found[i]);
+	}
+	free(w->found);
+	w->found = NULL;
+	w->nfound = 0;
+}
+
+/*
+ * Search refs/ of the repo at "dirname" for stale locks. The first two
+ * levels (refs/heads, refs/remotes/origin...) are listed here and the
+ * directories below them are searched in parallel.
+ */
+static void audit_ref_locks(char *dirname)
+{
+	struct lock_walk top = { .now = audit_now }, *walks;
+	char *refs, **level1 = NULL, **level2 = NULL;
+	int n1 = 0, n2 = 0, i;
+
+	refs = malloc(strlen(dirname) + sizeof("/refs"));
+	sprintf(refs, "%s/refs", dirname);
+	lock_walk_dir(&top, refs, &level1, &n1);
+	for (i = 0; i < n1; i++) {
+		lock_walk_dir(&top, level1[i], &level2, &n2);
+		free(level1[i]);
+	}
+	print_locks(&top);
+
+	if (opt_sort && level2 != NULL)
+		qsort(level2, n2, sizeof(*level2), str_cmp);
+	walks = calloc(n2, sizeof(*walks));
+	for (i = 0; i < n2; i++) {
+		walks[i].dirname = level2[i];
+		walks[i].now = audit_now;
+	}
+	pool_run(n2, lock_walk_one, walks);
+	for (i = 0; i < n2; i++) {
+		print_locks(&walks[i]);
+		free(level2[i]);
+	}
+
+	free(walks);
+	free(level1);
+	free(level2);
+	free(refs);
+}
+
+/* Add up "path" into "g"; -1 if it is gone already. */
+static int garbage_size(const char *path, struct garbage *g)
+{
+	struct stat st;
+	DIR *dirp;
+	struct dirent *direntp;
+	char *sub;
+
+	throttle_op();
+	if (lstat(path, &st) < 0)
+		return -1;
+	g->size += st.st_blocks * 512;
+	if (st.st_mtime > g->mtime)
+		g->mtime = st.st_mtime;
+	if (!S_ISDIR(st.st_mode))
+		return 0;
+	if ((dirp = opendir_try(path)) == NULL) {
+		if (errno != ENOENT)
+			report_error(path, errno);
+		return 0;
+	}
+
+	while ((direntp = read_entry(dirp, path)) != NULL) {
+		if (!strcmp(direntp->d_name, "."))
+			continue;
+		else if (!strcmp(direntp->d_name, ".."))
+			continue;
+		sub = malloc(strlen(path) + strlen(direntp->d_name) + 2);
+		sprintf(sub, "%s/%s", path, direntp->d_name);
+		garbage_size(sub, g);
+		free(sub);
+	}
+
+	closedir(dirp);
+	return 0;
+}
+
+static int garbage_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct garbage *)a)->path,
+		      ((const struct garbage *)b)->path);
+}
+
+static void garbage_size_one(void *arg, size_t i)
+{
+	struct garbage *g = (struct garbage *)arg + i;
+
+	/* git may finish or clean up the leftover meanwhile */
+	g->gone = garbage_size(g->path, g) < 0;
+}
+
+/*
+ * Add the entries of objects<subdir> of the repo at "dirname" that match
+ * one of the garbage prefixes for that directory to "found".
+ */
+static void list_garbage(char *dirname, const char *subdir,
+			 struct garbage **found, int *n)
+{
+	char *path;
+	DIR *dirp;
+	struct dirent *direntp;
+	int i;
+
+	path = malloc(strlen(dirname) + sizeof("/objects") + strlen(subdir));
+	sprintf(path, "%s/objects%s", dirname, subdir);
+	if ((dirp = opendir_try(path)) == NULL) {
+		if (errno != ENOENT)
+			report_error(path, errno);
+		free(path);
+		return;
+	}
+
+	while ((direntp = read_entry(dirp, path)) != NULL) {
+		for (i = 0; i < garbage_prefixes_array_size; i++) {
+			if (!strcmp(garbage_prefixes[i][0], subdir) &&
+			    !strncmp(direntp->d_name, garbage_prefixes[i][1],
+				     strlen(garbage_prefixes[i][1])))
+				break;
+		}
+		if (i == garbage_prefixes_array_size)
+			continue;
+
+		*found = realloc(*found, (*n + 1) * sizeof(**found));
+		(*found)[*n].path = malloc(strlen(path) +
+					   strlen(direntp->d_name) + 2);
+		sprintf((*found)[*n].path, "%s/%s", path, direntp->d_name);
+		(*found)[*n].size = 0;
+		(*found)[*n].mtime = 0;
+		(*n)++;
+	}
+
+	closedir(dirp);
+	free(path);
+}
+
+/* Find the temporary leftovers in objects/ of the repo at "dirname". */
+static void scan_garbage(char *dirname)
+{
+	struct garbage *found = NULL;
+	char age[32];
+	unsigned long long total = 0;
+	int i, n = 0, nstale = 0;
+
+	list_garbage(dirname, "", &found, &n);
+	list_garbage(dirname, "/pack", &found, &n);
+
+	pool_run(n, garbage_size_one, found);
+	if (opt_sort && n > 0)
+		qsort(found, n, sizeof(*found), garbage_cmp);
+
+	for (i = 0; i < n; i++) {
+		if (!found[i].gone &&
+		    audit_now - found[i].mtime >= opt_garbage_age) {
+			format_duration(age, sizeof(age),
+					audit_now - found[i].mtime);
+			report("GARBAGE: %s %llu bytes, %s old\n",
+			       found[i].path, found[i].size, age);
+			total += found[i].size;
+			nstale++;
+		}
+		free(found[i].path);
+	}
+	free(found);
+
+	if (nstale) {
+		tally.garbage += nstale;
+		tally.garbage_bytes += total;
+		report("GARBAGE: %s %llu bytes reclaimable in %d leftovers\n",
+		       dirname, total, nstale);
+	}
+}
+
+static const EVP_MD *verify_md(int hashlen)
+{
+	return hashlen == 32 ? EVP_sha256() : EVP_sha1();
+}
+
+/* Check the trailing checksum of a pack or .idx mapped at "map". */
+static void verify_checksum(struct verify_item *item, unsigned char *map,
+			    size_t len)
+{
+	unsigned char sum[EVP_MAX_MD_SIZE];
+
+	if (len < (size_t)item->hashlen * 2 + 8) {
+		item->err = "file is truncated";
+		return;
+	}
+
+	memcpy(item->trailer, map + len - item->hashlen, item->hashlen);
+	if (item->kind == VERIFY_IDX)
+		memcpy(item->pack_sum, map + len - 2 * item->hashlen,
+		       item->hashlen);
+
+	if (!EVP_Digest(map, len - item->hashlen, sum, NULL,
+			verify_md(item->hashlen), NULL) ||
+	    memcmp(sum, item->trailer, item->hashlen))
+		item->err = "checksum mismatch";
+}
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/*
+ * Inflate a loose object and compare the hash of "<type> <size>\0<data>"
+ * with the object name spelled by its path, .../objects/xx/yyyy...
+ */
+static void verify_loose(struct verify_item *item, unsigned char *map,
+			 size_t len)
+{
+	unsigned char buf[65536], sum[EVP_MAX_MD_SIZE], name[32];
+	char *hex = item->path + strlen(item->path) - item->hashlen * 2 - 1;
+	EVP_MD_CTX *ctx;
+	z_stream zs;
+	int i, ret;
+
+	for (i = 0; i < item->hashlen; i++) {
+		if (i == 1)
+			hex++;	/* skip the '/' after the fan-out dir */
+		name[i] = hexval(hex[2 * i]) << 4 | hexval(hex[2 * i + 1]);
+	}
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		item->err = "cannot inflate";
+		return;
+	}
+	ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, verify_md(item->hashlen), NULL);
+
+	zs.next_in = map;
+	zs.avail_in = len;
+	do {
+		zs.next_out = buf;
+		zs.avail_out = sizeof(buf);
+		ret = inflate(&zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END)
+			break;
+		EVP_DigestUpdate(ctx, buf, sizeof(buf) - zs.avail_out);
+	} while (ret == Z_OK);
+
+	EVP_DigestFinal_ex(ctx, sum, NULL);
+	EVP_MD_CTX_free(ctx);
+	inflateEnd(&zs);
+
+	if (ret != Z_STREAM_END)
+		item->err = "cannot inflate";
+	else if (memcmp(sum, name, item->hashlen))
+		item->err = "object hash mismatch";
+}
+
+static void verify_one(void *arg, size_t i)
+{
+	struct verify_item *item = (struct verify_item *)arg + i;
+	struct stat st;
+	unsigned char *map;
+	int fd;
+
+	throttle_op();
+	if ((fd = open(item->path, O_RDONLY)) < 0) {
+		item->err = strerror(errno);
+		return;
+	}
+	throttle_op();
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		item->err = "file is truncated";
+		close(fd);
+		return;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		item->err = strerror(errno);
+		return;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if (item->kind == VERIFY_LOOSE)
+		verify_loose(item, map, st.st_size);
+	else
+		verify_checksum(item, map, st.st_size);
+
+	munmap(map, st.st_size);
+}
+
+static void verify_add(struct verify_item **items, int *n, const char *dir,
+		       const char *name, enum verify_kind kind, int hashlen)
+{
+	struct verify_item *item;
+
+	*items = realloc(*items, (*n + 1) * sizeof(**items));
+	item = &(*items)[(*n)++];
+	memset(item, 0, sizeof(*item));
+	item->path = malloc(strlen(dir) + strlen(name) + 2);
+	sprintf(item->path, "%s/%s", dir, name);
+	item->kind = kind;
+	item->hashlen = hashlen;
+}
+
+/* Queue every pack of the repo and its .idx for verification. */
+static void verify_list_packs(char *objects, struct verify_item **items,
+			      int *n)
+{
+	char *path, *name;
+	DIR *dirp;
+	struct dirent *direntp;
+	size_t len;
+
+	path = malloc(strlen(objects) + sizeof("/pack"));
+	sprintf(path, "%s/pack", objects);
+	if ((dirp = opendir_try(path)) == NULL) {
+		if (errno != ENOENT)
+			report_error(path, errno);
+		free(path);
+		return;
+	}
+
+	while ((direntp = read_entry(dirp, path)) != NULL) {
+		name = direntp->d_name;
+		len = strlen(name);
+		if (strncmp(name, "pack-", 5) || len < 5 + 40 + 5 ||
+		    strcmp(name + len - 5, ".pack"))
+			continue;
+		/* the name is as long as the repo's hash in hex */
+		verify_add(items, n, path, name, VERIFY_PACK,
+			   (len - 10) / 2);
+		strcpy(name + len - 5, ".idx");
+		verify_add(items, n, path, name, VERIFY_IDX,
+			   (len - 10) / 2);
+	}
+
+	closedir(dirp);
+	free(path);
+}
+
+/*
+ * Reservoir-sample opt_verify_sample loose objects of the repo, seeded
+ * by its path so that repeated runs check the same objects.
+ */
+static void verify_sample_loose(char *objects, struct verify_item **items,
+				int *n)
+{
+	char *path, fanout[3];
+	DIR *dirp;
+	struct dirent *direntp;
+	unsigned int seed = string_hash(objects);
+	int i, k, seen = 0, first = *n, hashlen;
+	size_t len;
+
+	path = malloc(strlen(objects) + 4);
+	for (i = 0; i < 256; i++) {
+		sprintf(fanout, "%02x", i);
+		sprintf(path, "%s/%s", objects, fanout);
+		if ((dirp = opendir_try(path)) == NULL) {
+			if (errno != ENOENT)
+				report_error(path, errno);
+			continue;
+		}
+		while ((direntp = read_entry(dirp, path)) != NULL) {
+			len = strlen(direntp->d_name);
+			/* git's tmp_obj_* leftovers can be 38 long too */
+			if ((len != 38 && len != 62) ||
+			    strspn(direntp->d_name, "0123456789abcdef") != len)
+				continue;
+			hashlen = (len + 2) / 2;
+			seen++;
+			if (*n - first < opt_verify_sample) {
+				verify_add(items, n, path, direntp->d_name,
+					   VERIFY_LOOSE, hashlen);
+				continue;
+			}
+			k = rand_r(&seed) % seen;
+			if (k >= opt_verify_sample)
+				continue;
+			free((*items)[first + k].path);
+			(*items)[first + k].path = malloc(strlen(path) + len + 2);
+			sprintf((*items)[first + k].path, "%s/%s", path,
+				direntp->d_name);
+			(*items)[first + k].hashlen = hashlen;
+		}
+		closedir(dirp);
+	}
+	free(path);
+}
+
+static int verify_item_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct verify_item *)a)->path,
+		      ((const struct verify_item *)b)->path);
+}
+
+static void verify_repo(char *dirname)
+{
+	struct verify_item *items = NULL;
+	char *objects;
+	int i, n = 0;
+
+	objects = malloc(strlen(dirname) + sizeof("/objects"));
+	sprintf(objects, "%s/objects", dirname);
+	verify_list_packs(objects, &items, &n);
+	if (opt_verify_sample > 0)
+		verify_sample_loose(objects, &items, &n);
+	free(objects);
+
+	/* hashing is CPU bound, it would only skew -j auto */
+	pool_batch(n, verify_one, items, 0);
+
+	for (i = 0; i < n; i++) {
+		/* packs and their .idx are queued next to each other */
+		if (items[i].kind == VERIFY_IDX && !items[i].err &&
+		    !items[i - 1].err &&
+		    memcmp(items[i].pack_sum, items[i - 1].trailer,
+			   items[i].hashlen))
+			items[i].err = "index does not match pack";
+	}
+	if (opt_sort && n > 0)
+		qsort(items, n, sizeof(*items), verify_item_cmp);
+
+	for (i = 0; i < n; i++) {
+		tally.verified++;
+		if (items[i].err) {
+			tally.corrupt++;
+			report("CORRUPT: %s: %s\n", items[i].path,
+			       items[i].err);
+		}
+		free(items[i].path);
+	}
+	free(items);
+}
+
+/*
+ * Return the timestamp of the last entry of the reflog at "path", 0 if
+ * there is none. Only the tail is read: REFLOG_TAIL bytes, more if the
+ * last line does not fit.
+ */
+static time_t reflog_tail_time(const char *path)
+{
+	char *buf = NULL, *end, *line, *p;
+	size_t want = REFLOG_TAIL;
+	struct stat st;
+	ssize_t len;
+	off_t off;
+	time_t t = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+		goto out;
+
+	for (;;) {
+		off = st.st_size > (off_t)want ? st.st_size - (off_t)want : 0;
+		buf = realloc(buf, want + 1);
+		if ((len = pread(fd, buf, want, off)) <= 0)
+			goto out;
+		buf[len] = '\0';
+
+		end = buf + len;
+		while (end > buf && end[-1] == '\n')
+			end--;
+		*end = '\0';
+		line = memrchr(buf, '\n', end - buf);
+		if (line != NULL) {
+			line++;
+			break;
+		}
+		if (off == 0) {
+			line = buf;
+			break;
+		}
+		if (want >= REFLOG_TAIL_MAX)
+			goto out;
+		want *= 2;
+	}
+
+	/* <old> <new> <name> <<email>> <timestamp> <tz>\t<message> */
+	if ((p = strchr(line, '\t')) != NULL)
+		*p = '\0';
+	if ((p = strrchr(line, '>')) != NULL)
+		t = strtol(p + 1, NULL, 10);
+out:
+	free(buf);
+	close(fd);
+	return t;
+}
+
+/* Find the most recently modified file below "dirname". */
+static void newest_file(const char *dirname, char **newest, time_t *mtime)
+{
+	DIR *dirp;
+	struct dirent *direntp;
+	struct stat st;
+	char *path;
+
+	if ((dirp = opendir_try(dirname)) == NULL) {
+		if (errno != ENOENT)
+			report_error(dirname, errno);
+		return;
+	}
+
+	while ((direntp = read_entry(dirp, dirname)) != NULL) {
+		if (!strcmp(direntp->d_name, "."))
+			continue;
+		else if (!strcmp(direntp->d_name, ".."))
+			continue;
+		path = malloc(strlen(dirname) + strlen(direntp->d_name) + 2);
+		sprintf(path, "%s/%s", dirname, direntp->d_name);
+		if (direntp->d_type == DT_DIR) {
+			newest_file(path, newest, mtime);
+			free(path);
+			continue;
+		}
+		throttle_op();
+		if (fstatat(dirfd(dirp), direntp->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) == 0 && st.st_mtime > *mtime) {
+			*mtime = st.st_mtime;
+			free(*newest);
+			*newest = path;
+			continue;
+		}
+		free(path);
+	}
+
+	closedir(dirp);
+}
+
+static time_t newer_mtime(const char *dirname, const char *name, time_t t)
+{
+	struct stat st;
+	char *path;
+
+	path = malloc(strlen(dirname) + strlen(name) + 2);
+	sprintf(path, "%s/%s", dirname, name);
+	throttle_op();
+	if (stat(path, &st) == 0 && st.st_mtime > t)
+		t = st.st_mtime;
+	free(path);
+	return t;
+}
+
+/*
+ * Return the time of the last recorded activity in the repo at "dirname":
+ * the newest of the HEAD reflog, the most recently written branch reflog
+ * and the ref files. A server's HEAD branch can be stale while pushes
+ * land on other branches.
+ */
+static time_t repo_activity(char *dirname)
+{
+	char *path, *newest = NULL;
+	time_t t, ref_t, mtime = 0;
+
+	path = malloc(strlen(dirname) + sizeof("/logs/refs"));
+	sprintf(path, "%s/logs/HEAD", dirname);
+	t = reflog_tail_time(path);
+
+	sprintf(path, "%s/logs/refs", dirname);
+	newest_file(path, &newest, &mtime);
+	if (newest != NULL) {
+		ref_t = reflog_tail_time(newest);
+		if (ref_t > t)
+			t = ref_t;
+	}
+	free(newest);
+	free(path);
+
+	t = newer_mtime(dirname, "packed-refs", t);
+	t = newer_mtime(dirname, "refs/heads", t);
+	t = newer_mtime(dirname, "refs/tags", t);
+
+	return t;
+}
+
+static void check_idle(char *dirname)
+{
+	time_t t = repo_activity(dirname);
+	long days;
+	char date[16];
+	struct tm tm;
+
+	tally.last_activity = t;
+	if (t == 0)
+		return;
+	days = (audit_now - t) / 86400;
+	if (days < opt_idle_days)
+		return;
+
+	strftime(date, sizeof(date), "%Y-%m-%d", localtime_r(&t, &tm));
+	tally.idle++;
+	report("IDLE: %s last activity %s (%ld days)\n", dirname, date, days);
+}
+
+static void inv_open(void)
+{
+	struct inv_header h;
+
+	memset(&h, 0, sizeof(h));
+	if ((inv_fp = fopen(opt_inventory, "w+")) == NULL ||
+	    (inv_names = tmpfile()) == NULL) {
+		fprintf(stderr, "gitree: cannot create inventory %s\n",
+			opt_inventory);
+		exit(-1);
+	}
+	/* placeholder, rewritten by inv_close() */
+	fwrite(&h, sizeof(h), 1, inv_fp);
+}
+
+static void inv_snapshot(struct inv_snap *snap)
+{
+	snap->not_in_git = sum_not_in_git;
+	snap->stray_alloc = du_stray_alloc;
+}
+
+/*
+ * Append the record of "dirname" under record "parent" and return its
+ * index. Directories below a parent record store their last path
+ * component only. A directory's counts come from the counters since
+ * "snap" was taken, a repo's from its tally "t".
+ */
+static uint32_t inv_add(char *dirname, enum inv_kind kind, uint32_t parent,
+			struct inv_snap *snap, struct tally *t)
+{
+	struct inv_record rec;
+	const char *name = dirname;
+	size_t len;
+	uint32_t i;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.parent = parent;
+	rec.first_child = INV_NONE;
+	rec.next_sibling = INV_NONE;
+	rec.kind = kind;
+	if (rec.parent != INV_NONE && strrchr(dirname, '/'))
+		name = strrchr(dirname, '/') + 1;
+	if (t) {
+		if (t->non_bare)
+			rec.flags |= INV_NON_BARE;
+		if (t->name_not_git)
+			rec.flags |= INV_NAME_NOT_GIT;
+		if (t->corrupt)
+			rec.flags |= INV_CORRUPT;
+		if (t->idle)
+			rec.flags |= INV_IDLE;
+		rec.files = t->breaks;
+		rec.locks = t->stale_locks;
+		rec.corrupt = t->corrupt;
+		rec.size = t->repo_alloc;
+		rec.garbage = t->garbage_bytes;
+		rec.activity = t->last_activity;
+	} else if (snap) {
+		rec.files = sum_not_in_git - snap->not_in_git;
+		rec.size = du_stray_alloc - snap->stray_alloc;
+	}
+
+	pthread_mutex_lock(&inv_lock);
+	rec.name = inv_names_len;
+	len = strlen(name) + 1;
+	fwrite(name, len, 1, inv_names);
+	inv_names_len += len;
+	fwrite(&rec, sizeof(rec), 1, inv_fp);
+	i = inv_nrecords++;
+	pthread_mutex_unlock(&inv_lock);
+	return i;
+}
+
+/*
+ * Finish the inventory: append the name pool and the counters, write
+ * the real header and link every record into its parent's child list.
+ */
+static void inv_close(void)
+{
+	struct inv_header h;
+	struct inv_counter c;
+	struct inv_record *rec;
+	unsigned char *map;
+	char buf[65536];
+	size_t len, n;
+	uint64_t i;
+	int k;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, INV_MAGIC, sizeof(h.magic));
+	h.version = INV_VERSION;
+	h.flags = budget_exhausted ? INV_PARTIAL : 0;
+	h.record_size = sizeof(struct inv_record);
+	h.nrecords = inv_nrecords;
+	h.records_off = sizeof(h);
+	h.names_off = h.records_off + inv_nrecords * sizeof(*rec);
+	h.names_len = inv_names_len;
+	h.first_root = INV_NONE;
+
+	rewind(inv_names);
+	while ((n = fread(buf, 1, sizeof(buf), inv_names)) > 0)
+		fwrite(buf, 1, n, inv_fp);
+	fclose(inv_names);
+
+	/* keep the counters 8-byte aligned */
+	for (len = h.names_len; len % 8; len++)
+		fputc('\0', inv_fp);
+	h.counters_off = h.names_off + len;
+	for (k = 0; k < counters_array_size; k++, h.ncounters++) {
+		memset(&c, 0, sizeof(c));
+		strncpy(c.name, counters[k].name, sizeof(c.name) - 1);
+		c.value = *counters[k].value;
+		fwrite(&c, sizeof(c), 1, inv_fp);
+	}
+	for (k = 0; k < totals_array_size; k++, h.ncounters++) {
+		memset(&c, 0, sizeof(c));
+		strncpy(c.name, totals[k].name, sizeof(c.name) - 1);
+		c.value = *totals[k].value;
+		fwrite(&c, sizeof(c), 1, inv_fp);
+	}
+
+	len = h.counters_off + h.ncounters * sizeof(c);
+	if (fflush(inv_fp) || ferror(inv_fp)) {
+		fprintf(stderr, "gitree: cannot write inventory %s\n",
+			opt_inventory);
+		exit(-1);
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fileno(inv_fp), 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "gitree: cannot map inventory %s\n",
+			opt_inventory);
+		exit(-1);
+	}
+	rec = (struct inv_record *)(map + h.records_off);
+	for (i = inv_nrecords; i-- > 0; ) {
+		if (rec[i].parent == INV_NONE) {
+			rec[i].next_sibling = h.first_root;
+			h.first_root = i;
+		} else {
+			rec[i].next_sibling = rec[rec[i].parent].first_child;
+			rec[rec[i].parent].first_child = i;
+		}
+	}
+	memcpy(map, &h, sizeof(h));
+	munmap(map, len);
+	fclose(inv_fp);
+}
+
+static void inv_load(const char *file, struct inventory *inv)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "gitree: cannot open inventory %s\n", file);
+		exit(-1);
+	}
+	inv->len = st.st_size;
+	inv->map = mmap(NULL, inv->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (inv->map == MAP_FAILED || inv->len < sizeof(*inv->h)) {
+		fprintf(stderr, "gitree: cannot map inventory %s\n", file);
+		exit(-1);
+	}
+
+	inv->h = (struct inv_header *)inv->map;
+	if (memcmp(inv->h->magic, INV_MAGIC, sizeof(inv->h->magic)) ||
+	    inv->h->version != INV_VERSION ||
+	    inv->h->record_size != sizeof(struct inv_record) ||
+	    inv->h->counters_off + inv->h->ncounters *
+	    sizeof(struct inv_counter) > inv->len) {
+		fprintf(stderr, "gitree: %s is not an inventory\n", file);
+		exit(-1);
+	}
+	inv->rec = (struct inv_record *)(inv->map + inv->h->records_off);
+	inv->names = (char *)inv->map + inv->h->names_off;
+	inv->counters = (struct inv_counter *)(inv->map +
+					       inv->h->counters_off);
+}
+
+/* Build the full path of record "i" into "buf". */
+static void inv_path(struct inventory *inv, uint32_t i, char *buf,
+		     size_t size)
+{
+	uint32_t chain[PATH_MAX / 2];
+	int depth = 0;
+	size_t len = 0;
+
+	for (; i != INV_NONE && depth < PATH_MAX / 2;
+	     i = inv->rec[i].parent)
+		chain[depth++] = i;
+
+	buf[0] = '\0';
+	while (depth-- > 0) {
+		len += snprintf(buf + len, size - len, "%s%s",
+				len ? "/" : "",
+				inv->names + inv->rec[chain[depth]].name);
+		if (len >= size)
+			break;
+	}
+}
+
+static int path_under(const char *path, const char *prefix, size_t plen)
+{
+	return !strncmp(path, prefix, plen) &&
+	       (path[plen] == '\0' || path[plen] == '/' ||
+		(plen && prefix[plen - 1] == '/'));
+}
+
+/* gitree query INVENTORY [PREFIX] */
+static int query_main(int argc, char *argv[])
+{
+	struct inventory inv;
+	char path[PATH_MAX];
+	const char *prefix = argc > 3 ? argv[3] : "";
+	size_t plen = strlen(prefix);
+	unsigned long long repos = 0, strays = 0;
+	uint64_t i;
+
+	inv_load(argv[2], &inv);
+	for (i = 0; i < inv.h->nrecords; i++) {
+		if (inv.rec[i].kind != INV_REPO && !inv.rec[i].files)
+			continue;
+		inv_path(&inv, i, path, sizeof(path));
+		if (!path_under(path, prefix, plen))
+			continue;
+		if (inv.rec[i].kind == INV_REPO) {
+			repos++;
+			printf("%s\n", path);
+		} else {
+			strays += inv.rec[i].files;
+		}
+	}
+
+	printf("%llu repos, %llu files not in a git tree%s\n", repos, strays,
+	       inv.h->flags & INV_PARTIAL ? " (partial scan)" : "");
+	return 0;
+}
+
+/*
+ * gitree diff: both inventories are walked together from the roots down.
+ * At each directory the children of both sides are sorted by name and
+ * merged, so memory is bounded by the width of the directories on the
+ * current path, not by the size of the tree.
+ */
+static const struct {
+	unsigned int flag;
+	const char *what;
+} inv_flag_names[] = {
+	{ INV_NON_BARE,		"non-bare git tree" },
+	{ INV_NAME_NOT_GIT,	"name not terminated with .git" },
+	{ INV_CORRUPT,		"corrupt files" },
+	{ INV_IDLE,		"idle" },
+};
+
+static int inv_flag_names_array_size
+	= sizeof(inv_flag_names) / sizeof(inv_flag_names[0]);
+
+static int inv_name_cmp(const void *a, const void *b, void *arg)
+{
+	struct inventory *inv = arg;
+
+	return strcmp(inv->names + inv->rec[*(uint32_t *)a].name,
+		      inv->names + inv->rec[*(uint32_t *)b].name);
+}
+
+/* Return the sorted children of "i", or of the roots for INV_NONE. */
+static uint32_t *inv_children(struct inventory *inv, uint32_t i, size_t *n)
+{
+	uint32_t *child = NULL, c;
+	size_t size = 0;
+
+	*n = 0;
+	c = i == INV_NONE ? inv->h->first_root : inv->rec[i].first_child;
+	for (; c != INV_NONE; c = inv->rec[c].next_sibling) {
+		if (*n == size) {
+			size = size * 2 + 16;
+			child = realloc(child, size * sizeof(*child));
+		}
+		child[(*n)++] = c;
+	}
+	if (*n > 1)
+		qsort_r(child, *n, sizeof(*child), inv_name_cmp, inv);
+	return child;
+}
+
+static void inv_join(char *path, const char *dir, const char *name)
+{
+	if (*dir)
+		snprintf(path, PATH_MAX, "%s/%s", dir, name);
+	else
+		snprintf(path, PATH_MAX, "%s", name);
+}
+
+static void diff_count(const char *path, uint32_t a, uint32_t b,
+		       const char *what)
+{
+	if (a != b)
+		printf("~ %s: %u -> %u %s\n", path, a, b, what);
+}
+
+/*
+ * Compare the record of one directory in both inventories. Pass an
+ * empty record for the side where the directory does not exist.
+ */
+static void diff_record(const struct inv_record *a,
+			const struct inv_record *b, const char *path)
+{
+	static const struct inv_record none = { .kind = INV_SKIPPED };
+	const struct inv_record *ra, *rb, *da, *db;
+	int k;
+
+	if (a->kind != b->kind) {
+		if (a->kind == INV_REPO || a->kind == INV_ERROR)
+			printf("- %s %s\n",
+			       a->kind == INV_REPO ? "repo" : "error", path);
+		if (b->kind == INV_REPO || b->kind == INV_ERROR)
+			printf("+ %s %s\n",
+			       b->kind == INV_REPO ? "repo" : "error", path);
+	}
+
+	/* repo findings on one side, stray files on the other */
+	ra = a->kind == INV_REPO ? a : &none;
+	rb = b->kind == INV_REPO ? b : &none;
+	da = a->kind == INV_DIR ? a : &none;
+	db = b->kind == INV_DIR ? b : &none;
+
+	for (k = 0; k < inv_flag_names_array_size; k++) {
+		if ((ra->flags ^ rb->flags) & inv_flag_names[k].flag)
+			printf("%c %s: %s\n",
+			       rb->flags & inv_flag_names[k].flag ? '+' : '-',
+			       path, inv_flag_names[k].what);
+	}
+	diff_count(path, ra->files, rb->files, "layout rule breaks");
+	diff_count(path, ra->locks, rb->locks, "stale locks");
+	diff_count(path, ra->corrupt, rb->corrupt, "corrupt files");
+	diff_count(path, da->files, db->files, "files not in a git tree");
+}
+
+/* Report everything in the subtree at "i" as added ('+') or removed. */
+static void diff_subtree(struct inventory *inv, uint32_t i, const char *path,
+			 char sign)
+{
+	static const struct inv_record none = { .kind = INV_SKIPPED };
+	struct inv_record *r = &inv->rec[i];
+	char sub[PATH_MAX];
+	uint32_t c;
+
+	if (sign == '+')
+		diff_record(&none, r, path);
+	else
+		diff_record(r, &none, path);
+
+	for (c = r->first_child; c != INV_NONE; c = inv->rec[c].next_sibling) {
+		inv_join(sub, path, inv->names + inv->rec[c].name);
+		diff_subtree(inv, c, sub, sign);
+	}
+}
+
+/* Merge the children of "a" in "old" with those of "b" in "new". */
+static void diff_dir(struct inventory *old, uint32_t a,
+		     struct inventory *new, uint32_t b, const char *path)
+{
+	uint32_t *ca, *cb;
+	size_t na, nb, i = 0, j = 0;
+	char sub[PATH_MAX];
+	int cmp;
+
+	ca = inv_children(old, a, &na);
+	cb = inv_children(new, b, &nb);
+
+	while (i < na || j < nb) {
+		if (i == na)
+			cmp = 1;
+		else if (j == nb)
+			cmp = -1;
+		else
+			cmp = strcmp(old->names + old->rec[ca[i]].name,
+				     new->names + new->rec[cb[j]].name);
+
+		if (cmp < 0) {
+			inv_join(sub, path, old->names + old->rec[ca[i]].name);
+			diff_subtree(old, ca[i++], sub, '-');
+		} else if (cmp > 0) {
+			inv_join(sub, path, new->names + new->rec[cb[j]].name);
+			diff_subtree(new, cb[j++], sub, '+');
+		} else {
+			inv_join(sub, path, old->names + old->rec[ca[i]].name);
+			diff_record(&old->rec[ca[i]], &new->rec[cb[j]], sub);
+			diff_dir(old, ca[i++], new, cb[j++], sub);
+		}
+	}
+
+	free(ca);
+	free(cb);
+}
+
+/* gitree diff OLD NEW */
+static int diff_main(int argc, char *argv[])
+{
+	struct inventory old, new;
+	uint32_t i, j;
+	long long delta;
+	int header = 0;
+
+	(void)argc;
+	inv_load(argv[2], &old);
+	inv_load(argv[3], &new);
+
+	diff_dir(&old, INV_NONE, &new, INV_NONE, "");
+
+	for (j = 0; j < new.h->ncounters; j++) {
+		for (i = 0; i < old.h->ncounters; i++)
+			if (!strcmp(old.counters[i].name, new.counters[j].name))
+				break;
+		delta = new.counters[j].value -
+			(i < old.h->ncounters ? old.counters[i].value : 0);
+		if (!delta)
+			continue;
+		if (!header++)
+			printf("\nCounter changes:\n");
+		printf("%s %+lld\n", new.counters[j].name, delta);
+	}
+
+	return 0;
 }
 
 static int in_exception_list(char *dirname)
@@ -119,6 +3754,87 @@ static int in_exception_list(char *dirname)
 		return 1;
 }
 
+/*
+ * Whether a directory with entry "name" of type "d_type" can still be a
+ * repo: "objects" and "refs" have to be directories, "HEAD" a file.
+ */
+static int repo_marker_ok(const char *name, int d_type)
+{
+	if (!strcmp(name, "objects") || !strcmp(name, "refs"))
+		return d_type == DT_DIR;
+	if (!strcmp(name, "HEAD"))
+		return d_type == DT_REG;
+	return 1;
+}
+
+static void stray_file(struct stray *s, const char *name)
+{
+	if (s->excepted)
+		return;
+	s->count++;
+	if (opt_du) {
+		du_add(&s->du, s->dirname, name, 0);
+		if (s->du.n == DU_BATCH)
+			du_flush(&s->du);
+	}
+	if (opt_summary)
+		return;
+
+	if (opt_sort || (opt_aggregate && s->nfiles < opt_aggregate)) {
+		if (s->nfiles == s->files_size) {
+			s->files_size = s->files_size ? s->files_size * 2 : 64;
+			s->files = realloc(s->files,
+					   s->files_size * sizeof(*s->files));
+		}
+		s->files[s->nfiles++] = strdup(name);
+	} else if (!opt_aggregate) {
+		report("WARNING: %s/%s not in a git tree\n", s->dirname, name);
+	}
+}
+
+/* Count the files of a finished directory, report those kept back. */
+static void stray_done(struct stray *s)
+{
+	unsigned long long bytes = 0;
+	int j;
+
+	sum_not_in_git += s->count;
+	if (opt_du && s->count)
+		bytes = du_stray(s->dirname, &s->du);
+	if (opt_sort && s->nfiles > 0)
+		qsort(s->files, s->nfiles, sizeof(*s->files), str_cmp);
+
+	if (opt_aggregate && s->count > opt_aggregate) {
+		report("WARNING: %s: %d files not in a git tree",
+			s->dirname, s->count);
+		if (opt_du)
+			report(", %llu bytes", bytes);
+		report(", first:");
+		for (j = 0; j < s->nfiles && j < opt_aggregate_samples; j++)
+			report(" %s", s->files[j]);
+		report("\n");
+	} else {
+		for (j = 0; j < s->nfiles; j++)
+			report("WARNING: %s/%s not in a git tree\n",
+				s->dirname, s->files[j]);
+	}
+
+	for (j = 0; j < s->nfiles; j++)
+		free(s->files[j]);
+	free(s->files);
+}
+
+/* Forget what was collected of a directory that could not be read. */
+static void stray_drop(struct stray *s)
+{
+	int j;
+
+	du_free(&s->du);
+	for (j = 0; j < s->nfiles; j++)
+		free(s->files[j]);
+	free(s->files);
+}
+
 static void check_gitree(char *dirname)
 {
 	char *last_dir;
@@ -127,6 +3843,10 @@ static void check_gitree(char *dirname)
 	DIR *dirp;
 	struct dirent *direntp;
 	int i;
+	long age;
+	struct lock_walk locks = { .now = audit_now };
+	char **breaks = NULL;
+	int nbreaks = 0;
 
 	last_dir = strrchr(dirname, '/');
 	if (last_dir == NULL)
@@ -141,41 +3861,269 @@ static void check_gitree(char *dirname)
 
 	if ((dir_name_with_git == 1) && (dir_len == 4)) {
 		if (!in_exception_list(dirname)) {
-			sum_non_bare_git++;
-			printf("WARNING: %s non-bare git tree\n", dirname);
+			tally.non_bare++;
+			report("WARNING: %s non-bare git tree\n", dirname);
 		}
 	}
 
 	if (!dir_name_with_git) {
-		sum_dir_name_not_with_git++;
-		printf("WARNING: %s name not terminated with .git\n",
+		tally.name_not_git++;
+		report("WARNING: %s name not terminated with .git\n",
 			dirname);
 	}
 
-	if ((dirp = opendir(dirname)) == NULL) {
-		fprintf(stderr, "check_gitree: opendir failed\n");
-		exit(-1);
-	}
+	if ((dirp = opendir_retry(dirname)) == NULL)
+		return;
 
-	while ((direntp = readdir(dirp)) != NULL) {
+	while ((direntp = read_entry(dirp, dirname)) != NULL) {
 		if (!strcmp(direntp->d_name, "."))
 			continue;
 		else if (!strcmp(direntp->d_name, ".."))
 			continue;
+		if (opt_locks && is_lock_name(direntp->d_name)) {
+			age = stale_lock_age(&locks, dirfd(dirp),
+					     direntp->d_name);
+			if (age >= 0)
+				lock_found(&locks, dirname, direntp->d_name,
+					   age);
+			continue;
+		}
 		for (i = 0; i < git_files_array_size; i++) {
 			if (!strcmp(direntp->d_name, git_files[i]))
 				break;
 		}
-		if (i != git_files_array_size) {
+		if (i != git_files_array_size)
+			continue;
+		if (opt_summary) {
+			tally.breaks++;
 			continue;
-		} else {
-			sum_break_layout_rule++;
-			printf("WARNING: %s/%s breaks Git repo layout rule\n",
-				dirname, direntp->d_name);
 		}
+		breaks = realloc(breaks, (nbreaks + 1) * sizeof(*breaks));
+		breaks[nbreaks++] = strdup(direntp->d_name);
 	}
 
 	closedir(dirp);
+
+	if (opt_sort && nbreaks > 0)
+		qsort(breaks, nbreaks, sizeof(*breaks), str_cmp);
+	for (i = 0; i < nbreaks; i++) {
+		tally.breaks++;
+		report("WARNING: %s/%s breaks Git repo layout rule\n",
+			dirname, breaks[i]);
+		free(breaks[i]);
+	}
+	free(breaks);
+
+	if (opt_locks) {
+		print_locks(&locks);
+		audit_ref_locks(dirname);
+	}
+	if (opt_dup_packs)
+		index_packs(dirname);
+}
+
+/* Run the per-repo checks of "job", counting into its tally. */
+static void validate_repo(struct repo_job *job)
+{
+	memset(&tally, 0, sizeof(tally));
+	audit_now = time(NULL);
+	check_gitree(job->dirname);
+	if (opt_du)
+		du_repo(job->dirname);
+	if (opt_garbage)
+		scan_garbage(job->dirname);
+	if (opt_verify)
+		verify_repo(job->dirname);
+	if (opt_idle_days >= 0)
+		check_idle(job->dirname);
+	job->tally = tally;
+}
+
+/*
+ * Add the findings of a validated repo to the totals. Repos are done in
+ * report order, so the inventory and the top lists do not depend on
+ * which worker finished first.
+ */
+static void repo_done(struct repo_job *job)
+{
+	struct tally *t = &job->tally;
+
+	sum_break_layout_rule += t->breaks;
+	sum_non_bare_git += t->non_bare;
+	sum_dir_name_not_with_git += t->name_not_git;
+	sum_stale_locks += t->stale_locks;
+	sum_garbage += t->garbage;
+	garbage_bytes += t->garbage_bytes;
+	sum_verified += t->verified;
+	sum_corrupt += t->corrupt;
+	if (t->corrupt)
+		sum_corrupt_repos++;
+	sum_idle += t->idle;
+	if (opt_du)
+		du_repo_done(job->dirname, t);
+	if (opt_inventory)
+		inv_add(job->dirname, INV_REPO, job->inv_parent, NULL, t);
+
+	free(job->dirname);
+	free(job);
+}
+
+/* Start a new segment for this thread's output, waiting for room. */
+static struct segment *segment_open(void)
+{
+	struct segment *seg;
+
+	pthread_mutex_lock(&output_lock);
+	while (seg_next - seg_emit >= REORDER_MAX)
+		pthread_cond_wait(&output_cond, &output_lock);
+	seg = &segments[seg_next++ % REORDER_MAX];
+	pthread_mutex_unlock(&output_lock);
+
+	seg->job = NULL;
+	seg->fp = open_memstream(&seg->buf, &seg->len);
+	out = seg->fp;
+	return seg;
+}
+
+/*
+ * Mark "seg" complete and write out every complete segment that is next
+ * in order, accounting their repos.
+ */
+static void segment_done(struct segment *seg)
+{
+	fclose(seg->fp);
+	out = stdout;		/* repo_done reports the size directly */
+
+	pthread_mutex_lock(&output_lock);
+	seg->done = 1;
+	for (;;) {
+		seg = &segments[seg_emit % REORDER_MAX];
+		if (seg_emit == seg_next || !seg->done)
+			break;
+		fwrite(seg->buf, 1, seg->len, stdout);
+		free(seg->buf);
+		if (seg->job)
+			repo_done(seg->job);
+		seg->done = 0;
+		seg_emit++;
+	}
+	pthread_cond_broadcast(&output_cond);
+	pthread_mutex_unlock(&output_lock);
+}
+
+static void queue_push(struct repo_job *job)
+{
+	unsigned long pos;
+
+	sem_wait(&queue.slots);
+	pos = __atomic_fetch_add(&queue.tail, 1, __ATOMIC_RELAXED);
+	/* wait for the worker that took the previous job in this cell */
+	while (__atomic_load_n(&queue.cells[pos % QUEUE_SIZE].seq,
+			       __ATOMIC_ACQUIRE) != pos)
+		sched_yield();
+	queue.cells[pos % QUEUE_SIZE].job = job;
+	__atomic_store_n(&queue.cells[pos % QUEUE_SIZE].seq, pos + 1,
+			 __ATOMIC_RELEASE);
+	sem_post(&queue.items);
+}
+
+static struct repo_job *queue_pop(void)
+{
+	unsigned long pos;
+	struct repo_job *job;
+
+	sem_wait(&queue.items);
+	pos = __atomic_fetch_add(&queue.head, 1, __ATOMIC_RELAXED);
+	/* wait for the producer that claimed this cell to fill it */
+	while (__atomic_load_n(&queue.cells[pos % QUEUE_SIZE].seq,
+			       __ATOMIC_ACQUIRE) != pos + 1)
+		sched_yield();
+	job = queue.cells[pos % QUEUE_SIZE].job;
+	__atomic_store_n(&queue.cells[pos % QUEUE_SIZE].seq, pos + QUEUE_SIZE,
+			 __ATOMIC_RELEASE);
+	sem_post(&queue.slots);
+	return job;
+}
+
+static void *validate_worker(void *arg)
+{
+	struct repo_job *job;
+
+	(void)arg;
+	while ((job = queue_pop()) != NULL) {
+		out = job->seg->fp;
+		validate_repo(job);
+		segment_done(job->seg);
+	}
+
+	return NULL;
+}
+
+/*
+ * Hand the repo to the validation workers. Its report goes to the end of
+ * the current segment, after the discovery output leading to it, and
+ * discovery carries on in a new one.
+ */
+static void queue_repo(struct repo_job *job)
+{
+	job->seg = discovery_seg;
+	discovery_seg->job = job;
+	fflush(discovery_seg->fp);
+	queue_push(job);
+	discovery_seg = segment_open();
+}
+
+static void pipeline_start(void)
+{
+	int i;
+
+	for (i = 0; i < QUEUE_SIZE; i++)
+		queue.cells[i].seq = i;
+	sem_init(&queue.items, 0, 0);
+	sem_init(&queue.slots, 0, QUEUE_SIZE);
+
+	validators = calloc(opt_validate_jobs, sizeof(*validators));
+	for (i = 0; i < opt_validate_jobs; i++) {
+		if (pthread_create(&validators[i], NULL, validate_worker, NULL))
+			break;
+	}
+	nvalidators = i;
+	if (nvalidators)
+		discovery_seg = segment_open();
+}
+
+/*
+ * Wait until every queued repo is validated and everything printed so
+ * far is on stdout, with the totals up to date: checkpoints and budget
+ * stops need a quiet pipeline.
+ */
+static void pipeline_drain(void)
+{
+	if (!nvalidators)
+		return;
+
+	segment_done(discovery_seg);
+	pthread_mutex_lock(&output_lock);
+	while (seg_emit != seg_next)
+		pthread_cond_wait(&output_cond, &output_lock);
+	pthread_mutex_unlock(&output_lock);
+	discovery_seg = segment_open();
+}
+
+static void pipeline_stop(void)
+{
+	int i;
+
+	if (!nvalidators)
+		return;
+
+	for (i = 0; i < nvalidators; i++)
+		queue_push(NULL);
+	for (i = 0; i < nvalidators; i++)
+		pthread_join(validators[i], NULL);
+	segment_done(discovery_seg);
+	out = stdout;
+	nvalidators = 0;
 }
 
 static void gitree(char *dirname)
@@ -187,32 +4135,114 @@ static void gitree(char *dirname)
 	 */
 	DIR *dirp;
 	struct dirent *direntp;
-	char *subdir[SUBDIRNO];
+	char **subdir = NULL;
 	int i = 0, subdirn, str_len, dir_len, subdir_len;
 	int has_dir_objects = 0, has_dir_refs = 0;
 	int has_file_HEAD = 0;
-	char *subfile[SUBFILENO];
-	int j = 0, subfilen, subfile_len;
+	int j = 0, subfile_len;
+	int d_type, is_link;
+	struct stat st;
+	double weight;
+	struct timespec start;
+	struct inv_snap snap;
+	char **skipped = NULL;
+	int nskipped = 0;
+	struct stray stray;
+	char *pending[STREAM_BUFFER];
+	int npending = 0;
+	enum stream_state state = STREAM_BUFFERING;
+	struct repo_job *job;
+	ino_t *subdir_ino = NULL;
+	double slept;
+	int read_failed;
+	int subdir_size = 0;
 
-	if ((dirp = opendir(dirname)) == NULL) {
-		fprintf(stderr, "gitree: opendir failed\n");
-		exit(-1);
+	dirs_scanned++;
+	progress_inc(dirs);
+	weight = walk_nodes[walk_current].weight;
+	/* the time spent sleeping for tokens or retries is not latency */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	slept = throttle_slept;
+
+	if ((dirp = opendir_walk(dirname)) == NULL) {
+		if (opt_inventory)
+			inv_add(dirname, INV_ERROR, walk_inv_parent(),
+				NULL, NULL);
+		return;
+	}
+
+	if (opt_follow) {
+		throttle_op();
+		if (fstat(dirfd(dirp), &st) < 0) {
+			report_error(dirname, errno);
+			closedir(dirp);
+			if (opt_inventory)
+				inv_add(dirname, INV_ERROR, walk_inv_parent(),
+					NULL, NULL);
+			return;
+		}
+		if (!devino_set_insert(&visited, st.st_dev, st.st_ino)) {
+			report("Skipping %s already visited\n", dirname);
+			closedir(dirp);
+			if (opt_inventory)
+				inv_add(dirname, INV_SKIPPED,
+					walk_inv_parent(), NULL, NULL);
+			return;
+		}
 	}
 
-	printf("Checking %s\n", dirname);
+	report("Checking %s\n", dirname);
+
+	inv_snapshot(&snap);
+	memset(&stray, 0, sizeof(stray));
+	stray.dirname = dirname;
+	stray.excepted = in_exception_list(dirname);
 
 	dir_len = strlen(dirname);
-	while ((direntp = readdir(dirp)) != NULL) {
+	while ((direntp = read_entry(dirp, dirname)) != NULL) {
 		if (!strcmp(direntp->d_name, "."))
 			continue;
 		else if (!strcmp(direntp->d_name, ".."))
 			continue;
-		if (direntp->d_type == DT_DIR) {
+		/* only the walk counts, not what the repo checks read */
+		progress_inc(entries);
+		d_type = direntp->d_type;
+		is_link = 0;
+		if (d_type == DT_LNK && opt_follow) {
+			d_type = follow_link(dirp, direntp->d_name);
+			is_link = 1;
+		}
+		if (state == STREAM_BUFFERING &&
+		    !repo_marker_ok(direntp->d_name, d_type)) {
+			/* cannot be a repo, stop buffering */
+			for (j = 0; j < npending; j++) {
+				stray_file(&stray, pending[j]);
+				free(pending[j]);
+			}
+			npending = 0;
+			state = STREAM_FILES;
+		}
+		if (d_type == DT_DIR) {
 			if (!strcmp(direntp->d_name, "objects"))
 				has_dir_objects = 1;
 			if (!strcmp(direntp->d_name, "refs"))
 				has_dir_refs = 1;
 
+			if (opt_one_file_system &&
+			    on_other_fs(dirp, direntp->d_name, is_link)) {
+				skipped = realloc(skipped, (nskipped + 1) *
+						  sizeof(*skipped));
+				skipped[nskipped++] = strdup(direntp->d_name);
+				continue;
+			}
+
+			if (i == subdir_size) {
+				subdir_size = subdir_size ? subdir_size * 2 : 64;
+				subdir = realloc(subdir,
+						 subdir_size * sizeof(*subdir));
+				subdir_ino = realloc(subdir_ino, subdir_size *
+						     sizeof(*subdir_ino));
+			}
 			subdir_len = strlen(direntp->d_name);
 			str_len = dir_len + 1 + subdir_len;
 			subdir[i] = malloc(str_len + 1);
@@ -220,80 +4250,525 @@ static void gitree(char *dirname)
 			strcat(subdir[i], "/");
 			strcat(subdir[i], direntp->d_name);
 			subdir[i][str_len] = '\0';
+			subdir_ino[i] = direntp->d_ino;
 			i++;
-			if (i >= SUBDIRNO) {
-				fprintf(stderr, "ERROR: gitree: reach max dir num\n");
-				exit(-1);
-			}
-		} else if (direntp->d_type == DT_REG) {
+		} else if (d_type == DT_REG) {
 			if (!strcmp(direntp->d_name, "HEAD"))
 				has_file_HEAD = 1;
 
-			subfile_len = strlen(direntp->d_name);
-			subfile[j] = malloc(subfile_len + 1);
-			strcpy(subfile[j], direntp->d_name);
-			subfile[j][subfile_len] = '\0';
-			j++;
-			if (j >= SUBFILENO) {
-				fprintf(stderr, "ERROR: gitree: reach max file num\n");
-				exit(-1);
+			if (state == STREAM_FILES) {
+				stray_file(&stray, direntp->d_name);
+			} else if (state == STREAM_BUFFERING &&
+				   npending < STREAM_BUFFER) {
+				subfile_len = strlen(direntp->d_name);
+				pending[npending] = malloc(subfile_len + 1);
+				strcpy(pending[npending], direntp->d_name);
+				npending++;
+			} else if (state == STREAM_BUFFERING) {
+				for (j = 0; j < npending; j++)
+					free(pending[j]);
+				npending = 0;
+				state = STREAM_MARKERS;
 			}
 		} else if (direntp->d_type == DT_UNKNOWN) {
 			fprintf(stderr, "ERROR: gitree: unknown file type\n");
 			exit(-2);
 		}
+		/* the rest of a repo is left to check_gitree() */
+		if (has_dir_objects && has_dir_refs && has_file_HEAD)
+			break;
+	}
+	read_failed = direntp == NULL && errno != 0;
+
+	if (read_failed) {
+		/*
+		 * A partial listing says nothing about the layout: the repo
+		 * markers may just not have come yet. Leave it at the error;
+		 * only the warnings already streamed out for it stay.
+		 */
+		for (j = 0; j < npending; j++)
+			free(pending[j]);
+		for (j = 0; j < i; j++)
+			free(subdir[j]);
+		free(subdir);
+		free(subdir_ino);
+		for (j = 0; j < nskipped; j++)
+			free(skipped[j]);
+		free(skipped);
+		stray_drop(&stray);
+		closedir(dirp);
+		if (opt_inventory)
+			inv_add(dirname, INV_ERROR, walk_inv_parent(),
+				NULL, NULL);
+		return;
+	}
+
+	if (!(has_dir_objects && has_dir_refs && has_file_HEAD) &&
+	    state == STREAM_MARKERS) {
+		/* the entries were counted the first time */
+		rewinddir(dirp);
+		while ((direntp = read_entry(dirp, dirname)) != NULL) {
+			d_type = direntp->d_type;
+			if (d_type == DT_LNK && opt_follow)
+				d_type = follow_link(dirp, direntp->d_name);
+			if (d_type == DT_REG)
+				stray_file(&stray, direntp->d_name);
+		}
+	}
+	for (j = 0; j < npending; j++) {
+		if (!(has_dir_objects && has_dir_refs && has_file_HEAD))
+			stray_file(&stray, pending[j]);
+		free(pending[j]);
 	}
 
+	if (i > 0 && opt_fd_budget > 0 &&
+	    !(has_dir_objects && has_dir_refs && has_file_HEAD))
+		fd_cache_put(walk_current, dup(dirfd(dirp)));
 	closedir(dirp);
+	if (opt_backoff_latency > 0)
+		throttle_feedback(elapsed(&start) - (throttle_slept - slept));
 
 	subdirn = i;
-	subfilen = j;
+	if (opt_sort) {
+		if (subdirn > 0)
+			qsort(subdir, subdirn, sizeof(*subdir), str_cmp);
+		if (nskipped > 0)
+			qsort(skipped, nskipped, sizeof(*skipped), str_cmp);
+	} else if (opt_inode_order) {
+		inode_sort(subdir, subdir_ino, subdirn);
+	} else if (costs.count) {
+		cost_sort(subdir, subdirn);
+	}
+	for (i = 0; i < nskipped; i++) {
+		report("Skipping %s/%s on another filesystem\n",
+			dirname, skipped[i]);
+		free(skipped[i]);
+	}
+	free(skipped);
 
 	if (has_dir_objects && has_dir_refs && has_file_HEAD) {
 		for (i = 0; i < subdirn; i++)
 			free(subdir[i]);
-		for (j = 0; j < subfilen; j++)
-			free(subfile[j]);
-		check_gitree(dirname);
+		progress_inc(repos);
+		job = calloc(1, sizeof(*job));
+		job->dirname = strdup(dirname);
+		job->inv_parent = walk_inv_parent();
+		if (nvalidators) {
+			queue_repo(job);
+		} else {
+			validate_repo(job);
+			repo_done(job);
+		}
 	} else {
-		for (j = 0; j < subfilen; j++) {
-			if (!in_exception_list(dirname)) {
-				sum_not_in_git++;
-				printf("WARNING: %s/%s not in a git tree\n",
-					dirname, subfile[j]);
+		stray_done(&stray);
+		if (opt_inventory)
+			walk_nodes[walk_current].inv =
+				inv_add(dirname, INV_DIR, walk_inv_parent(),
+					&snap, NULL);
+		/* the names only, the parent node holds the rest */
+		for (i = 0; i < subdirn; i++)
+			memmove(subdir[i], subdir[i] + dir_len + 1,
+				strlen(subdir[i] + dir_len + 1) + 1);
+		walk_push_list(walk_current, subdir, subdirn,
+			       weight / subdirn, NULL);
+		for (i = 0; i < subdirn; i++)
+			free(subdir[i]);
+	}
+	free(subdir);
+	free(subdir_ino);
+}
+
+/*
+ * Check the budgets before scanning the next directory. Once one is used
+ * up, remember what is left to scan for the summary, leave a checkpoint
+ * to pick up from in the next window, and stop the walk.
+ */
+static int budget_exceeded(void)
+{
+	if (budget_exhausted)
+		return 1;
+	if (opt_max_dirs && dirs_scanned >= opt_max_dirs)
+		budget_exhausted = 1;
+	if (opt_time_budget && time(NULL) - scan_start >= opt_time_budget)
+		budget_exhausted = 1;
+	if (!budget_exhausted)
+		return 0;
+
+	pipeline_drain();
+	unvisited_n = collect_pending(&unvisited, &unvisited_weights);
+	if (opt_checkpoint)
+		write_checkpoint();
+	return 1;
+}
+
+/*
+ * Scan the top-level list of directories, either the root given on the
+ * command line or the pending list of a checkpoint, and everything below
+ * them, checking the budgets and taking checkpoints between directories.
+ */
+static void gitree_list(char **subdir, double *weights, int subdirn)
+{
+	char *dirname;
+	time_t now;
+	struct timespec start;
+	unsigned long entries = 0;
+
+	walk_push_list(WALK_NONE, subdir, subdirn, 1.0, weights);
+
+	while (walk_len) {
+		if (budget_exceeded())
+			break;
+		if (opt_checkpoint) {
+			now = time(NULL);
+			if (now - last_checkpoint >= opt_checkpoint_interval) {
+				pipeline_drain();
+				write_checkpoint();
+				last_checkpoint = now;
 			}
-			free(subfile[j]);
 		}
-		for (i = 0; i < subdirn; i++) {
-			gitree(subdir[i]);
-			free(subdir[i]);
+		walk_current = walk_take();
+		dirname = walk_path(walk_current);
+		if (opt_cost_file) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			entries = __atomic_load_n(&progress.entries,
+						  __ATOMIC_RELAXED);
 		}
+		gitree(dirname);
+		if (opt_cost_file) {
+			walk_nodes[walk_current].secs += elapsed(&start);
+			walk_nodes[walk_current].entries +=
+				__atomic_load_n(&progress.entries,
+						__ATOMIC_RELAXED) - entries;
+		}
+		free(dirname);
+		walk_release(walk_current);
+	}
+	walk_current = WALK_NONE;
+}
+
+static const struct option long_options[] = {
+	{ "one-file-system",	no_argument,	NULL,	'x' },
+	{ "follow",		no_argument,	NULL,	'L' },
+	{ "checkpoint",		required_argument, NULL, 'C' },
+	{ "checkpoint-interval", required_argument, NULL, 'I' },
+	{ "resume",		required_argument, NULL, 'R' },
+	{ "retries",		required_argument, NULL, 'r' },
+	{ "time-budget",	required_argument, NULL, 'T' },
+	{ "max-dirs",		required_argument, NULL, 'D' },
+	{ "max-dir-rate",	required_argument, NULL, 'd' },
+	{ "max-ops-rate",	required_argument, NULL, 'o' },
+	{ "backoff-latency",	required_argument, NULL, 'b' },
+	{ "idle-io",		no_argument,	NULL,	'i' },
+	{ "progress",		optional_argument, NULL, 'P' },
+	{ "status-file",	required_argument, NULL, 'S' },
+	{ "jobs",		required_argument, NULL, 'j' },
+	{ "du",			no_argument,	NULL,	'u' },
+	{ "top",		required_argument, NULL, 'k' },
+	{ "dup-packs",		no_argument,	NULL,	'p' },
+	{ "locks",		no_argument,	NULL,	'l' },
+	{ "lock-age",		required_argument, NULL, 'a' },
+	{ "garbage",		no_argument,	NULL,	'g' },
+	{ "garbage-age",	required_argument, NULL, 'G' },
+	{ "verify",		no_argument,	NULL,	'v' },
+	{ "verify-sample",	required_argument, NULL, 'V' },
+	{ "idle-days",		required_argument, NULL, 'y' },
+	{ "inventory",		required_argument, NULL, 'N' },
+	{ "sort",		no_argument,	NULL,	's' },
+	{ "inode-order",	no_argument,	NULL,	'O' },
+	{ "summary",		no_argument,	NULL,	'm' },
+	{ "aggregate",		required_argument, NULL, 'A' },
+	{ "aggregate-samples",	required_argument, NULL, 'M' },
+	{ "bfs",		required_argument, NULL, 'B' },
+	{ "cost-file",		required_argument, NULL, 'c' },
+	{ "validate-jobs",	required_argument, NULL, 'J' },
+	{ "fd-budget",		required_argument, NULL, 'F' },
+	{ NULL,			0,		NULL,	0 },
+};
+
+/* A non-negative integer option value; anything else is fatal. */
+static int parse_count(const char *arg, const char *option)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(arg, &end, 10);
+	if (errno || end == arg || *end != '\0' || n < 0 || n > INT_MAX) {
+		fprintf(stderr, "gitree: invalid --%s value %s\n", option, arg);
+		exit(-1);
 	}
+	return n;
 }
 
 int main(int argc, char *argv[])
 {
-	int dir_len;
+	int dir_len, c, i, pending;
+	char *root, *resume = NULL;
+	char **subdir;
+	double *weights = NULL, coverage;
+	struct stat st;
+
+	out = stdout;
+	if (argc >= 3 && argc <= 4 && !strcmp(argv[1], "query"))
+		return query_main(argc, argv);
+	if (argc == 4 && !strcmp(argv[1], "diff"))
+		return diff_main(argc, argv);
+
+	while ((c = getopt_long(argc, argv, "xLj:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'x':
+			opt_one_file_system = 1;
+			break;
+		case 'L':
+			opt_follow = 1;
+			break;
+		case 'C':
+			opt_checkpoint = optarg;
+			break;
+		case 'I':
+			opt_checkpoint_interval = parse_count(optarg,
+						"checkpoint-interval");
+			break;
+		case 'R':
+			resume = optarg;
+			break;
+		case 'r':
+			opt_retries = parse_count(optarg, "retries");
+			break;
+		case 'T':
+			opt_time_budget = parse_count(optarg, "time-budget");
+			break;
+		case 'D':
+			opt_max_dirs = parse_count(optarg, "max-dirs");
+			break;
+		case 'd':
+			opt_max_dir_rate = atof(optarg);
+			break;
+		case 'o':
+			op_bucket.rate = atof(optarg);
+			break;
+		case 'b':
+			opt_backoff_latency = atof(optarg) / 1000;
+			break;
+		case 'i':
+			opt_idle_io = 1;
+			break;
+		case 'P':
+			opt_progress = optarg ?
+				parse_count(optarg, "progress") : 5;
+			break;
+		case 'S':
+			opt_status_file = optarg;
+			break;
+		case 'j':
+			if (!strcmp(optarg, "auto"))
+				opt_jobs_auto = 1;
+			else
+				opt_jobs = parse_count(optarg, "jobs");
+			break;
+		case 'u':
+			opt_du = 1;
+			break;
+		case 'k':
+			opt_top = parse_count(optarg, "top");
+			break;
+		case 'p':
+			opt_dup_packs = 1;
+			break;
+		case 'l':
+			opt_locks = 1;
+			break;
+		case 'a':
+			opt_lock_age = parse_count(optarg, "lock-age");
+			break;
+		case 'g':
+			opt_garbage = 1;
+			break;
+		case 'G':
+			opt_garbage_age = parse_count(optarg, "garbage-age");
+			break;
+		case 'v':
+			opt_verify = 1;
+			break;
+		case 'V':
+			opt_verify_sample = parse_count(optarg,
+						"verify-sample");
+			break;
+		case 'y':
+			opt_idle_days = parse_count(optarg, "idle-days");
+			break;
+		case 'N':
+			opt_inventory = optarg;
+			break;
+		case 's':
+			opt_sort = 1;
+			break;
+		case 'O':
+			opt_inode_order = 1;
+			break;
+		case 'm':
+			opt_summary = 1;
+			break;
+		case 'A':
+			opt_aggregate = parse_count(optarg, "aggregate");
+			break;
+		case 'M':
+			opt_aggregate_samples = parse_count(optarg,
+							    "aggregate-samples");
+			break;
+		case 'B':
+			opt_bfs = parse_count(optarg, "bfs");
+			break;
+		case 'c':
+			opt_cost_file = optarg;
+			break;
+		case 'J':
+			opt_validate_jobs = parse_count(optarg,
+						"validate-jobs");
+			break;
+		case 'F':
+			opt_fd_budget = parse_count(optarg, "fd-budget");
+			break;
+		default:
+			usage();
+		}
+	}
+	if (opt_sort && opt_inode_order) {
+		fprintf(stderr, "gitree: --sort and --inode-order are "
+			"mutually exclusive\n");
+		exit(-1);
+	}
+	if (opt_jobs_auto && !(opt_du || opt_locks || opt_garbage)) {
+		fprintf(stderr, "gitree: -j auto needs --du, --locks or "
+			"--garbage to tune on\n");
+		exit(-1);
+	}
 
-	if (argc != 2)
-		usage();
+	if (resume) {
+		if (optind != argc)
+			usage();
+		/*
+		 * The hardlink set, the pack index and the inventory records
+		 * of the first part are not in the checkpoint.
+		 */
+		if (opt_du || opt_dup_packs || opt_inventory) {
+			fprintf(stderr, "gitree: --resume cannot continue a "
+				"scan with --du, --dup-packs or --inventory\n");
+			exit(-1);
+		}
+		if (opt_checkpoint == NULL)
+			opt_checkpoint = resume;
+		subdir = read_checkpoint(resume, &pending, &weights);
+		if (pending == 0) {
+			fprintf(stderr, "gitree: nothing left to scan\n");
+			exit(-1);
+		}
+		/* with -x every pending directory is on the root filesystem */
+		root = subdir[0];
+	} else {
+		if (optind != argc - 1)
+			usage();
+		root = argv[optind];
 
-	dir_len = strlen(argv[1]);
-	dir_len--;
-	while (argv[1][dir_len] == '/') {
-		argv[1][dir_len] = '\0';
+		dir_len = strlen(root);
 		dir_len--;
+		while (root[dir_len] == '/') {
+			root[dir_len] = '\0';
+			dir_len--;
+		}
+		subdir = &root;
+		pending = 1;
+	}
+
+	if (opt_one_file_system) {
+		if (stat(root, &st) < 0) {
+			fprintf(stderr, "gitree: stat %s failed\n", root);
+			exit(-1);
+		}
+		root_dev = st.st_dev;
 	}
 
-	gitree(argv[1]);
+	if (opt_idle_io)
+		set_idle_io();
+	fd_cache_init();
+	dir_bucket.rate = opt_max_dir_rate;
+	clock_gettime(CLOCK_MONOTONIC, &dir_bucket.last);
+	clock_gettime(CLOCK_MONOTONIC, &op_bucket.last);
+
+	if (opt_du || opt_locks || opt_garbage || opt_verify)
+		pool_start();
+	if (opt_validate_jobs > 0)
+		pipeline_start();
+	if (opt_status_file && opt_progress <= 0)
+		opt_progress = 5;
+	if (opt_progress > 0)
+		start_progress(root);
+
+	if (opt_inventory)
+		inv_open();
+	if (opt_cost_file)
+		cost_load();
+
+	scan_start = time(NULL);
+	last_checkpoint = scan_start;
+	gitree_list(subdir, weights, pending);
+	pipeline_stop();
+	if (opt_progress > 0)
+		stop_progress();
+	if (opt_inventory)
+		inv_close();
+	if (opt_cost_file)
+		cost_save(!budget_exhausted && !resume);
+	if (opt_checkpoint && !budget_exhausted)
+		unlink(opt_checkpoint);
 
 	printf("\nCheck Result:\n"
 	       "%d files break Git repo layout rule\n"
 	       "%d git dirs name not terminated with .git\n"
 	       "%d git dirs non-bare git tree\n"
-	       "%d files not in a git tree\n",
+	       "%d files not in a git tree\n"
+	       "%d directories could not be read\n",
 	       sum_break_layout_rule, sum_dir_name_not_with_git,
-	       sum_non_bare_git, sum_not_in_git);
+	       sum_non_bare_git, sum_not_in_git, sum_errors);
+	if (opt_locks)
+		printf("%d stale lock files\n", sum_stale_locks);
+	if (opt_garbage)
+		printf("%d temporary leftovers, %llu bytes reclaimable\n",
+		       sum_garbage, garbage_bytes);
+	if (opt_verify)
+		printf("%d files verified, %d corrupt in %d repos\n",
+		       sum_verified, sum_corrupt, sum_corrupt_repos);
+	if (opt_idle_days >= 0)
+		printf("%d repos idle for %d days or more\n",
+		       sum_idle, opt_idle_days);
+	if (opt_du) {
+		printf("%llu bytes (%llu allocated) in git repos\n"
+		       "%llu bytes (%llu allocated) not in a git tree\n",
+		       du_repo_bytes, du_repo_alloc,
+		       du_stray_bytes, du_stray_alloc);
+		du_heap_print(&top_repos, "Largest repos");
+		du_heap_print(&top_strays, "Largest directories not in a git tree");
+	}
+	if (opt_dup_packs)
+		report_dup_packs();
+	if (opt_jobs_auto && tune.windows)
+		printf("-j auto settled on %d jobs, %.0f items/sec "
+		       "at %.2f ms per item\n", tune.limit, tune.best_x,
+		       tune.min_w * 1000);
+
+	if (budget_exhausted) {
+		coverage = 1.0;
+		for (i = 0; i < unvisited_n; i++)
+			coverage -= unvisited_weights[i];
+		printf("\nScan stopped by budget after %d directories, "
+		       "%ld seconds\n"
+		       "about %.1f%% of the tree visited, "
+		       "%d subtrees not visited:\n",
+		       dirs_scanned, (long)(time(NULL) - scan_start),
+		       coverage * 100, unvisited_n);
+		for (i = 0; i < unvisited_n; i++)
+			printf("%s\n", unvisited[i]);
+	}
 
 	return 0;
 }